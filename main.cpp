@@ -4,151 +4,2772 @@
 #include <algorithm>
 #include <stdexcept>
 #include <sstream>
-#include <fstream>
+#include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <new>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <string_view>
+#include <chrono>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
 
 using namespace std;
 
 const int SECTOR_SIZE = 64;
+const size_t DENTRY_CACHE_SIZE = 4096;
+const size_t RECLAIM_BATCH = 4096;
+const size_t DIR_TREE_THRESHOLD = 1024;
+const size_t INLINE_DATA_LIMIT = 60;
+const size_t MAX_INLINE_DATA = 4096;
+const int COMPRESS_BLOCK_SECTORS = 64;
+const size_t BLOCK_CACHE_SIZE = 256;
+
+// Heap allocations made by each thread, so benchmarks can report allocations per operation.
+// Every plain, array and nothrow form is replaced so each allocation pairs with free().
+thread_local size_t heapAllocations = 0;
+
+void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    heapAllocations++;
+    return malloc(size ? size : 1);
+}
+
+void *operator new(size_t size)
+{
+    if (void *block = operator new(size, nothrow))
+        return block;
+    throw bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept
+{
+    return operator new(size, nothrow);
+}
+
+// Kept out of line so GCC does not pair the inlined free() with operator new and warn.
+__attribute__((noinline)) void operator delete(void *block) noexcept
+{
+    free(block);
+}
+
+void operator delete(void *block, size_t) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete(void *block, const nothrow_t &) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete[](void *block) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete[](void *block, size_t) noexcept
+{
+    operator delete(block);
+}
+
+void operator delete[](void *block, const nothrow_t &) noexcept
+{
+    operator delete(block);
+}
 
 class FileSystem
 {
 private:
-    class Item
+    struct Extent
+    {
+        int start;
+        int length;
+        int logical = 0; // sectors of data a compressed run expands to; 0 for raw runs
+    };
+
+    struct Tail
+    {
+        int sector = -1;
+        uint8_t offset = 0;
+        uint8_t length = 0;
+    };
+
+    typedef uint32_t Inode;
+    static constexpr Inode NO_INODE = UINT32_MAX;
+
+    enum InodeType : uint8_t
+    {
+        FREE_INODE,
+        FILE_INODE,
+        FOLDER_INODE
+    };
+
+    class DirIndex
+    {
+    private:
+        static constexpr Inode EMPTY = NO_INODE;
+        static constexpr Inode TOMBSTONE = NO_INODE - 1;
+        static const size_t SEGMENT_LIMIT = 65536;
+        static const int SEGMENT_BITS = 8;
+
+        struct Slot
+        {
+            size_t hash;
+            Inode inode;
+        };
+
+        struct Segment
+        {
+            vector<Slot> slots;
+            size_t used = 0;
+            size_t live = 0;
+        };
+
+        // One table until SEGMENT_LIMIT entries, then 256 tables picked by the top hash bits that each grow on their own.
+        vector<Segment> segments = vector<Segment>(1);
+
+        Segment &segmentFor(size_t hash)
+        {
+            return segments[(segments.size() == 1) ? 0 : hash >> (sizeof(size_t) * 8 - SEGMENT_BITS)];
+        }
+
+        const Segment &segmentFor(size_t hash) const
+        {
+            return segments[(segments.size() == 1) ? 0 : hash >> (sizeof(size_t) * 8 - SEGMENT_BITS)];
+        }
+
+        static void rehash(Segment &segment, size_t capacity)
+        {
+            vector<Slot> old;
+            old.swap(segment.slots);
+            segment.slots.assign(capacity, {0, EMPTY});
+            segment.used = segment.live = 0;
+            for (const Slot &slot : old)
+            {
+                if (slot.inode != EMPTY && slot.inode != TOMBSTONE)
+                    place(segment, slot.hash, slot.inode);
+            }
+        }
+
+        static void place(Segment &segment, size_t hash, Inode inode)
+        {
+            if ((segment.used + 1) * 10 > segment.slots.size() * 7)
+            {
+                size_t capacity = 8;
+                while (capacity < (segment.live + 1) * 2)
+                    capacity *= 2;
+                rehash(segment, capacity);
+            }
+
+            size_t mask = segment.slots.size() - 1;
+            size_t i = hash & mask;
+            while (segment.slots[i].inode != EMPTY && segment.slots[i].inode != TOMBSTONE)
+                i = (i + 1) & mask;
+            if (segment.slots[i].inode == EMPTY)
+                segment.used++;
+            segment.slots[i] = {hash, inode};
+            segment.live++;
+        }
+
+        void split()
+        {
+            Segment whole = move(segments[0]);
+            segments.assign(size_t(1) << SEGMENT_BITS, Segment());
+            for (const Slot &slot : whole.slots)
+            {
+                if (slot.inode != EMPTY && slot.inode != TOMBSTONE)
+                    place(segmentFor(slot.hash), slot.hash, slot.inode);
+            }
+        }
+
+    public:
+        static size_t hashOf(string_view name)
+        {
+            return std::hash<string_view>()(name);
+        }
+
+        template <typename NameOf>
+        Inode find(string_view name, NameOf nameOf) const
+        {
+            size_t hash = hashOf(name);
+            const Segment &segment = segmentFor(hash);
+            if (segment.slots.empty())
+                return NO_INODE;
+
+            size_t mask = segment.slots.size() - 1;
+            for (size_t i = hash & mask; segment.slots[i].inode != EMPTY; i = (i + 1) & mask)
+            {
+                const Slot &slot = segment.slots[i];
+                if (slot.inode != TOMBSTONE && slot.hash == hash && nameOf(slot.inode) == name)
+                    return slot.inode;
+            }
+            return NO_INODE;
+        }
+
+        void insert(Inode inode, string_view name)
+        {
+            if (segments.size() == 1 && segments[0].live >= SEGMENT_LIMIT)
+                split();
+            size_t hash = hashOf(name);
+            place(segmentFor(hash), hash, inode);
+        }
+
+        void erase(Inode inode, string_view name)
+        {
+            size_t hash = hashOf(name);
+            Segment &segment = segmentFor(hash);
+            if (segment.slots.empty())
+                return;
+
+            size_t mask = segment.slots.size() - 1;
+            for (size_t i = hash & mask; segment.slots[i].inode != EMPTY; i = (i + 1) & mask)
+            {
+                if (segment.slots[i].inode == inode)
+                {
+                    segment.slots[i].inode = TOMBSTONE;
+                    segment.live--;
+                    return;
+                }
+            }
+        }
+    };
+
+    class SortedChildren
     {
+    private:
+        vector<Inode> entries;
+
+        template <typename NameOf>
+        size_t bound(string_view name, bool inclusive, NameOf nameOf) const
+        {
+            if (inclusive)
+                return lower_bound(entries.begin(), entries.end(), name, [&](Inode inode, string_view key)
+                                   { return nameOf(inode) < key; }) -
+                       entries.begin();
+            return upper_bound(entries.begin(), entries.end(), name, [&](string_view key, Inode inode)
+                               { return key < nameOf(inode); }) -
+                   entries.begin();
+        }
+
     public:
-        bool isFolder;
-        string name;
-        string content;
-        vector<int> sectors;
-        vector<Item *> children;
-        Item *parent;
+        template <typename NameOf>
+        void insert(Inode inode, string_view name, NameOf nameOf)
+        {
+            entries.insert(entries.begin() + bound(name, true, nameOf), inode);
+        }
+
+        template <typename NameOf>
+        void erase(Inode inode, string_view name, NameOf nameOf)
+        {
+            size_t i = bound(name, true, nameOf);
+            if (i < entries.size() && entries[i] == inode)
+                entries.erase(entries.begin() + i);
+        }
+
+        void append(Inode inode)
+        {
+            entries.push_back(inode);
+        }
+
+        size_t size() const
+        {
+            return entries.size();
+        }
+
+        template <typename NameOf, typename Visit>
+        void scan(string_view from, bool inclusive, NameOf nameOf, Visit visit) const
+        {
+            for (size_t i = bound(from, inclusive, nameOf); i < entries.size(); i++)
+            {
+                if (!visit(entries[i]))
+                    return;
+            }
+        }
     };
-    vector<string> disk;
-    vector<bool> sectorMap;
-    Item *root;
-    Item *currentDir;
-    int totalSectors;
 
-    int allocateSector()
+    class ChildTree
+    {
+    private:
+        static const size_t LEAF_CAPACITY = 128;
+        static const size_t BRANCH_CAPACITY = 128;
+
+        struct Node
+        {
+            bool leaf = true;
+            vector<string> keys;
+            vector<unique_ptr<Node>> children;
+            vector<Inode> entries;
+            Node *next = nullptr;
+        };
+
+        unique_ptr<Node> root = make_unique<Node>();
+        size_t count = 0;
+
+        static size_t childFor(const Node *node, string_view name)
+        {
+            return upper_bound(node->keys.begin(), node->keys.end(), name, [](string_view key, const string &separator)
+                               { return key < separator; }) -
+                   node->keys.begin();
+        }
+
+        template <typename NameOf>
+        static size_t entryBound(const Node *leaf, string_view name, bool inclusive, NameOf nameOf)
+        {
+            auto begin = leaf->entries.begin();
+            auto end = leaf->entries.end();
+            if (inclusive)
+                return lower_bound(begin, end, name, [&](Inode inode, string_view key)
+                                   { return nameOf(inode) < key; }) -
+                       begin;
+            return upper_bound(begin, end, name, [&](string_view key, Inode inode)
+                               { return key < nameOf(inode); }) -
+                   begin;
+        }
+
+        Node *leafFor(string_view name) const
+        {
+            Node *node = root.get();
+            while (!node->leaf)
+                node = node->children[childFor(node, name)].get();
+            return node;
+        }
+
+        template <typename NameOf>
+        unique_ptr<Node> insertInto(Node *node, Inode inode, string_view name, NameOf nameOf, string &separator)
+        {
+            if (node->leaf)
+            {
+                size_t i = entryBound(node, name, true, nameOf);
+                node->entries.insert(node->entries.begin() + i, inode);
+                if (node->entries.size() <= LEAF_CAPACITY)
+                    return nullptr;
+
+                auto right = make_unique<Node>();
+                size_t half = node->entries.size() / 2;
+                right->entries.assign(node->entries.begin() + half, node->entries.end());
+                node->entries.resize(half);
+                right->next = node->next;
+                node->next = right.get();
+                separator = string(nameOf(right->entries.front()));
+                return right;
+            }
+
+            size_t i = childFor(node, name);
+            string childSeparator;
+            unique_ptr<Node> split = insertInto(node->children[i].get(), inode, name, nameOf, childSeparator);
+            if (!split)
+                return nullptr;
+
+            node->keys.insert(node->keys.begin() + i, move(childSeparator));
+            node->children.insert(node->children.begin() + i + 1, move(split));
+            if (node->children.size() <= BRANCH_CAPACITY)
+                return nullptr;
+
+            auto right = make_unique<Node>();
+            right->leaf = false;
+            size_t half = node->children.size() / 2;
+            separator = move(node->keys[half - 1]);
+            right->keys.assign(make_move_iterator(node->keys.begin() + half), make_move_iterator(node->keys.end()));
+            right->children.assign(make_move_iterator(node->children.begin() + half),
+                                   make_move_iterator(node->children.end()));
+            node->keys.resize(half - 1);
+            node->children.resize(half);
+            return right;
+        }
+
+        template <typename NameOf>
+        static bool eraseFrom(Node *node, Inode inode, string_view name, NameOf nameOf)
+        {
+            if (node->leaf)
+            {
+                size_t i = entryBound(node, name, true, nameOf);
+                if (i >= node->entries.size() || node->entries[i] != inode)
+                    return false;
+                node->entries.erase(node->entries.begin() + i);
+                return true;
+            }
+
+            size_t i = childFor(node, name);
+            if (!eraseFrom(node->children[i].get(), inode, name, nameOf))
+                return false;
+            mergeUnderfull(node, i);
+            return true;
+        }
+
+        // Folds a child that fell below half full into its neighbour when the two fit in one node.
+        static void mergeUnderfull(Node *node, size_t i)
+        {
+            Node *child = node->children[i].get();
+            size_t capacity = child->leaf ? LEAF_CAPACITY : BRANCH_CAPACITY;
+            size_t filled = child->leaf ? child->entries.size() : child->children.size();
+            if (filled >= capacity / 2 || node->children.size() < 2)
+                return;
+
+            size_t left = (i + 1 < node->children.size()) ? i : i - 1;
+            Node *into = node->children[left].get();
+            Node *from = node->children[left + 1].get();
+            if (into->leaf)
+            {
+                if (into->entries.size() + from->entries.size() > capacity)
+                    return;
+                into->entries.insert(into->entries.end(), from->entries.begin(), from->entries.end());
+                into->next = from->next;
+            }
+            else
+            {
+                if (into->children.size() + from->children.size() > capacity)
+                    return;
+                into->keys.push_back(move(node->keys[left]));
+                into->keys.insert(into->keys.end(), make_move_iterator(from->keys.begin()), make_move_iterator(from->keys.end()));
+                into->children.insert(into->children.end(), make_move_iterator(from->children.begin()),
+                                      make_move_iterator(from->children.end()));
+            }
+            node->keys.erase(node->keys.begin() + left);
+            node->children.erase(node->children.begin() + left + 1);
+        }
+
+    public:
+        size_t size() const
+        {
+            return count;
+        }
+
+        template <typename NameOf>
+        Inode find(string_view name, NameOf nameOf) const
+        {
+            const Node *leaf = leafFor(name);
+            size_t i = entryBound(leaf, name, true, nameOf);
+            if (i < leaf->entries.size() && nameOf(leaf->entries[i]) == name)
+                return leaf->entries[i];
+            return NO_INODE;
+        }
+
+        template <typename NameOf>
+        void insert(Inode inode, string_view name, NameOf nameOf)
+        {
+            string separator;
+            unique_ptr<Node> split = insertInto(root.get(), inode, name, nameOf, separator);
+            count++;
+            if (!split)
+                return;
+
+            auto top = make_unique<Node>();
+            top->leaf = false;
+            top->keys.push_back(move(separator));
+            top->children.push_back(move(root));
+            top->children.push_back(move(split));
+            root = move(top);
+        }
+
+        template <typename NameOf>
+        void erase(Inode inode, string_view name, NameOf nameOf)
+        {
+            if (!eraseFrom(root.get(), inode, name, nameOf))
+                return;
+
+            count--;
+            if (!root->leaf && root->children.size() == 1)
+                root = move(root->children[0]);
+        }
+
+        template <typename NameOf, typename Visit>
+        void scan(string_view from, bool inclusive, NameOf nameOf, Visit visit) const
+        {
+            const Node *leaf = leafFor(from);
+            for (size_t i = entryBound(leaf, from, inclusive, nameOf); leaf; leaf = leaf->next, i = 0)
+            {
+                for (; i < leaf->entries.size(); i++)
+                {
+                    if (!visit(leaf->entries[i]))
+                        return;
+                }
+            }
+        }
+    };
+
+    class InodeTable
+    {
+    private:
+        vector<Inode> parent;
+        vector<Inode> firstChild;
+        vector<Inode> nextSibling;
+        vector<Inode> prevSibling;
+        string names;
+        size_t deadNameBytes = 0;
+        Inode freeHead = NO_INODE;
+        struct Directory
+        {
+            DirIndex index;
+            SortedChildren order;
+            unique_ptr<ChildTree> tree;
+        };
+
+        struct NameOf
+        {
+            const InodeTable *table;
+
+            string_view operator()(Inode inode) const
+            {
+                return table->name(inode);
+            }
+        };
+
+        vector<Directory> directories;
+        vector<uint32_t> freeDirectories;
+        vector<uint32_t> generation;
+        vector<uint32_t> additions;
+
+        void storeName(Inode inode, string_view name)
+        {
+            uint32_t offset = names.size();
+            names.append(name.data(), name.size());
+            nameOffset[inode] = offset;
+            nameLength[inode] = name.size();
+        }
+
+        void dropName(uint32_t length)
+        {
+            deadNameBytes += length;
+            if (deadNameBytes < 4096 || deadNameBytes * 2 < names.size())
+                return;
+
+            string packed;
+            packed.reserve(names.size() - deadNameBytes);
+            for (Inode i = 0; i < type.size(); i++)
+            {
+                if (type[i] == FREE_INODE)
+                    continue;
+                uint32_t offset = packed.size();
+                packed.append(names, nameOffset[i], nameLength[i]);
+                nameOffset[i] = offset;
+            }
+            names.swap(packed);
+            deadNameBytes = 0;
+        }
+
+        Directory &directoryOf(Inode dir)
+        {
+            return directories[payload[dir]];
+        }
+
+        void indexChild(Inode dir, Inode child)
+        {
+            Directory &directory = directoryOf(dir);
+            directory.index.insert(child, name(child));
+            if (directory.tree)
+            {
+                directory.tree->insert(child, name(child), NameOf{this});
+                return;
+            }
+
+            directory.order.insert(child, name(child), NameOf{this});
+            if (directory.order.size() <= DIR_TREE_THRESHOLD)
+                return;
+
+            auto tree = make_unique<ChildTree>();
+            directory.order.scan("", true, NameOf{this}, [&](Inode entry)
+                                 {
+                                     tree->insert(entry, name(entry), NameOf{this});
+                                     return true;
+                                 });
+            directory.tree = move(tree);
+            directory.order = SortedChildren();
+        }
+
+        void unindexChild(Inode dir, Inode child)
+        {
+            Directory &directory = directoryOf(dir);
+            directory.index.erase(child, name(child));
+            if (!directory.tree)
+            {
+                directory.order.erase(child, name(child), NameOf{this});
+                return;
+            }
+
+            directory.tree->erase(child, name(child), NameOf{this});
+            if (directory.tree->size() >= DIR_TREE_THRESHOLD / 4)
+                return;
+
+            directory.tree->scan("", true, NameOf{this}, [&](Inode entry)
+                                 {
+                                     directory.order.append(entry);
+                                     return true;
+                                 });
+            directory.tree.reset();
+        }
+
+    public:
+        vector<uint8_t> type;
+        vector<uint64_t> size;
+        vector<uint32_t> nameOffset;
+        vector<uint32_t> nameLength;
+        vector<uint32_t> payload;
+        vector<uint32_t> epoch;
+        vector<vector<Extent>> extents;
+        vector<string> inlineData;
+        vector<Tail> tails;
+        uint32_t now = 0;
+
+        Inode count() const
+        {
+            return type.size();
+        }
+
+        bool isFolder(Inode inode) const
+        {
+            return type[inode] == FOLDER_INODE;
+        }
+
+        string_view name(Inode inode) const
+        {
+            return string_view(names).substr(nameOffset[inode], nameLength[inode]);
+        }
+
+        Inode parentOf(Inode inode) const
+        {
+            return parent[inode];
+        }
+
+        Inode firstChildOf(Inode dir) const
+        {
+            return firstChild[dir];
+        }
+
+        Inode nextSiblingOf(Inode inode) const
+        {
+            return nextSibling[inode];
+        }
+
+        uint32_t generationOf(Inode inode) const
+        {
+            return generation[inode];
+        }
+
+        uint32_t additionsOf(Inode dir) const
+        {
+            return additions[dir];
+        }
+
+        Inode create(InodeType kind, string_view name)
+        {
+            Inode inode = freeHead;
+            if (inode != NO_INODE)
+                freeHead = nextSibling[inode];
+            else
+            {
+                if (type.size() >= NO_INODE - 1)
+                    throw runtime_error("Inode table is full");
+                inode = type.size();
+                size_t grown = inode + 1;
+                parent.resize(grown);
+                firstChild.resize(grown);
+                nextSibling.resize(grown);
+                prevSibling.resize(grown);
+                type.resize(grown);
+                size.resize(grown);
+                nameOffset.resize(grown);
+                nameLength.resize(grown);
+                payload.resize(grown);
+                epoch.resize(grown);
+                extents.resize(grown);
+                inlineData.resize(grown);
+                tails.resize(grown);
+                generation.resize(grown);
+                additions.resize(grown);
+            }
+
+            parent[inode] = NO_INODE;
+            firstChild[inode] = NO_INODE;
+            nextSibling[inode] = NO_INODE;
+            prevSibling[inode] = NO_INODE;
+            type[inode] = kind;
+            size[inode] = 0;
+            payload[inode] = 0;
+            epoch[inode] = now;
+            storeName(inode, name);
+
+            if (kind == FOLDER_INODE)
+            {
+                if (freeDirectories.empty())
+                {
+                    payload[inode] = directories.size();
+                    directories.emplace_back();
+                }
+                else
+                {
+                    payload[inode] = freeDirectories.back();
+                    freeDirectories.pop_back();
+                }
+            }
+            return inode;
+        }
+
+        void destroy(Inode inode)
+        {
+            if (type[inode] == FOLDER_INODE)
+            {
+                directories[payload[inode]] = Directory();
+                freeDirectories.push_back(payload[inode]);
+            }
+            vector<Extent>().swap(extents[inode]);
+            string().swap(inlineData[inode]);
+            tails[inode] = Tail();
+
+            type[inode] = FREE_INODE;
+            generation[inode]++;
+            parent[inode] = NO_INODE;
+            firstChild[inode] = NO_INODE;
+            nextSibling[inode] = freeHead;
+            freeHead = inode;
+            dropName(nameLength[inode]);
+        }
+
+        Inode lookup(Inode dir, string_view name) const
+        {
+            if (type[dir] != FOLDER_INODE)
+                return NO_INODE;
+            return directories[payload[dir]].index.find(name, NameOf{this});
+        }
+
+        void link(Inode dir, Inode child)
+        {
+            parent[child] = dir;
+            prevSibling[child] = NO_INODE;
+            nextSibling[child] = firstChild[dir];
+            if (firstChild[dir] != NO_INODE)
+                prevSibling[firstChild[dir]] = child;
+            firstChild[dir] = child;
+            additions[dir]++;
+            indexChild(dir, child);
+        }
+
+        void unlink(Inode dir, Inode child)
+        {
+            unindexChild(dir, child);
+            Inode before = prevSibling[child];
+            Inode after = nextSibling[child];
+            if (before != NO_INODE)
+                nextSibling[before] = after;
+            else
+                firstChild[dir] = after;
+            if (after != NO_INODE)
+                prevSibling[after] = before;
+            parent[child] = NO_INODE;
+            nextSibling[child] = NO_INODE;
+            prevSibling[child] = NO_INODE;
+            generation[child]++;
+        }
+
+        Inode detachFirstChild(Inode dir)
+        {
+            Inode child = firstChild[dir];
+            if (child != NO_INODE)
+                unlink(dir, child);
+            return child;
+        }
+
+        void rename(Inode inode, string_view newName)
+        {
+            Inode dir = parent[inode];
+            if (dir != NO_INODE)
+                unindexChild(dir, inode);
+            uint32_t oldLength = nameLength[inode];
+            storeName(inode, newName);
+            generation[inode]++;
+            if (dir != NO_INODE)
+            {
+                additions[dir]++;
+                indexChild(dir, inode);
+            }
+            dropName(oldLength);
+        }
+
+        template <typename Visit>
+        void listChildren(Inode dir, string_view after, string_view prefix, size_t limit, Visit visit) const
+        {
+            string_view from = prefix;
+            bool inclusive = true;
+            if (!after.empty() && after >= prefix)
+            {
+                from = after;
+                inclusive = false;
+            }
+
+            auto each = [&](Inode child)
+            {
+                if (limit == 0 || name(child).substr(0, prefix.size()) != prefix)
+                    return false;
+                visit(child);
+                limit--;
+                return true;
+            };
+
+            const Directory &directory = directories[payload[dir]];
+            if (directory.tree)
+                directory.tree->scan(from, inclusive, NameOf{this}, each);
+            else
+                directory.order.scan(from, inclusive, NameOf{this}, each);
+        }
+    };
+
+    class DentryCache
+    {
+    private:
+        // Keys view the path stored in their own list entry, so probing copies nothing.
+        struct Key
+        {
+            Inode base;
+            string_view path;
+
+            bool operator==(const Key &other) const
+            {
+                return base == other.base && path == other.path;
+            }
+        };
+
+        struct KeyHash
+        {
+            size_t operator()(const Key &key) const
+            {
+                return std::hash<string_view>()(key.path) * 31 + key.base;
+            }
+        };
+
+        struct Stamp
+        {
+            Inode inode;
+            uint32_t generation;
+        };
+
+        // An entry stays valid while every inode its walk passed through keeps its
+        // generation; a miss also needs the folder it failed in to gain no children.
+        struct Entry
+        {
+            Inode base;
+            string path;
+            Inode inode;
+            vector<Stamp> walked;
+            uint32_t additions;
+        };
+
+        list<Entry> order;
+        unordered_map<Key, list<Entry>::iterator, KeyHash> entries;
+        size_t capacity;
+
+        static bool current(const Entry &entry, const InodeTable &inodes)
+        {
+            for (const Stamp &stamp : entry.walked)
+            {
+                if (inodes.generationOf(stamp.inode) != stamp.generation)
+                    return false;
+            }
+            return entry.inode != NO_INODE || inodes.additionsOf(entry.walked.back().inode) == entry.additions;
+        }
+
+        static void stamp(Entry &entry, const InodeTable &inodes, Inode inode, const vector<Inode> &walked)
+        {
+            entry.inode = inode;
+            entry.walked.clear();
+            for (Inode node : walked)
+                entry.walked.push_back({node, inodes.generationOf(node)});
+            entry.additions = inodes.additionsOf(walked.back());
+        }
+
+    public:
+        explicit DentryCache(size_t capacity) : capacity(capacity)
+        {
+        }
+
+        bool lookup(const InodeTable &inodes, Inode base, string_view path, Inode &inode)
+        {
+            auto it = entries.find(Key{base, path});
+            if (it == entries.end())
+                return false;
+
+            // A stale entry is left in place for store() to refresh.
+            Entry &entry = *it->second;
+            if (!current(entry, inodes))
+                return false;
+
+            order.splice(order.begin(), order, it->second);
+            inode = entry.inode;
+            return true;
+        }
+
+        void store(const InodeTable &inodes, Inode base, string_view path, Inode inode, const vector<Inode> &walked)
+        {
+            auto it = entries.find(Key{base, path});
+            if (it != entries.end())
+            {
+                stamp(*it->second, inodes, inode, walked);
+                order.splice(order.begin(), order, it->second);
+                return;
+            }
+
+            // Once full, the least recent entry is recycled with its list node, map
+            // node and buffers, so a steady stream of misses allocates nothing.
+            decltype(entries)::node_type slot;
+            if (entries.size() < capacity)
+                order.emplace_front();
+            else
+            {
+                slot = entries.extract(Key{order.back().base, order.back().path});
+                order.splice(order.begin(), order, prev(order.end()));
+            }
+
+            Entry &entry = order.front();
+            entry.base = base;
+            entry.path.assign(path.data(), path.size());
+            stamp(entry, inodes, inode, walked);
+            if (slot.empty())
+            {
+                entries.emplace(Key{base, entry.path}, order.begin());
+                return;
+            }
+            slot.key() = Key{base, entry.path};
+            slot.mapped() = order.begin();
+            entries.insert(move(slot));
+        }
+    };
+
+    class FreeExtents
+    {
+    private:
+        map<int, int> byOffset;
+        set<pair<int, int>> bySize;
+        int freeCount = 0;
+
+        void add(int start, int length)
+        {
+            byOffset[start] = length;
+            bySize.insert({length, start});
+            freeCount += length;
+        }
+
+        void erase(map<int, int>::iterator it)
+        {
+            freeCount -= it->second;
+            bySize.erase({it->second, it->first});
+            byOffset.erase(it);
+        }
+
+    public:
+        int available() const
+        {
+            return freeCount;
+        }
+
+        void reset(int start, int length)
+        {
+            byOffset.clear();
+            bySize.clear();
+            freeCount = 0;
+            if (length > 0)
+                add(start, length);
+        }
+
+        void release(int start, int length)
+        {
+            auto next = byOffset.lower_bound(start);
+            if (next != byOffset.begin())
+            {
+                auto prev = std::prev(next);
+                if (prev->first + prev->second == start)
+                {
+                    start = prev->first;
+                    length += prev->second;
+                    erase(prev);
+                }
+            }
+            if (next != byOffset.end() && start + length == next->first)
+            {
+                length += next->second;
+                erase(next);
+            }
+            add(start, length);
+        }
+
+        void claim(int start, int length)
+        {
+            auto it = byOffset.upper_bound(start);
+            if (it == byOffset.begin())
+                return;
+            --it;
+
+            int runStart = it->first;
+            int runEnd = runStart + it->second;
+            if (start + length > runEnd)
+                return;
+
+            erase(it);
+            if (start > runStart)
+                add(runStart, start - runStart);
+            if (start + length < runEnd)
+                add(start + length, runEnd - start - length);
+        }
+
+        int takeRun(int count)
+        {
+            auto fit = bySize.lower_bound({count, 0});
+            if (fit == bySize.end())
+                return -1;
+
+            int length = fit->first;
+            int start = fit->second;
+            erase(byOffset.find(start));
+            if (length > count)
+                add(start + count, length - count);
+            return start;
+        }
+
+        int takeAt(int start, int limit)
+        {
+            auto it = byOffset.find(start);
+            if (it == byOffset.end())
+                return 0;
+
+            int length = it->second;
+            int taken = min(length, limit);
+            erase(it);
+            if (length > taken)
+                add(start + taken, length - taken);
+            return taken;
+        }
+
+        Extent takeLargest(int limit)
+        {
+            if (bySize.empty())
+                return {-1, 0};
+
+            auto largest = prev(bySize.end());
+            int start = largest->second;
+            int length = min(largest->first, limit);
+            int rest = largest->first - length;
+            erase(byOffset.find(start));
+            if (rest > 0)
+                add(start + length, rest);
+            return {start, length};
+        }
+    };
+
+    class SectorBitmap
+    {
+    private:
+        vector<vector<uint64_t>> levels;
+        int bits = 0;
+
+        void updateSummary(int wordIndex)
+        {
+            for (size_t level = 1; level < levels.size(); level++)
+            {
+                uint64_t bit = uint64_t(1) << (wordIndex % 64);
+                uint64_t &word = levels[level][wordIndex / 64];
+                uint64_t old = word;
+                if (levels[level - 1][wordIndex] != 0)
+                    word |= bit;
+                else
+                    word &= ~bit;
+
+                if (word == old)
+                    return;
+                wordIndex /= 64;
+            }
+        }
+
+    public:
+        void resize(int count)
+        {
+            bits = count;
+            levels.clear();
+            int width = count;
+            do
+            {
+                width = (width + 63) / 64;
+                levels.emplace_back(width, 0);
+            } while (width > 1);
+        }
+
+        int size() const
+        {
+            return bits;
+        }
+
+        bool operator[](int index) const
+        {
+            return !(levels[0][index / 64] >> (index % 64) & 1);
+        }
+
+        void assign(int start, int length, bool used)
+        {
+            int end = start + length;
+            for (int i = start; i < end;)
+            {
+                uint64_t &word = levels[0][i / 64];
+                uint64_t mask = ~uint64_t(0);
+                int span = 64;
+                if (i % 64 != 0 || end - i < 64)
+                {
+                    span = min(64 - i % 64, end - i);
+                    mask = ((span == 64) ? ~uint64_t(0) : ((uint64_t(1) << span) - 1)) << (i % 64);
+                }
+
+                if (used)
+                    word &= ~mask;
+                else
+                    word |= mask;
+                updateSummary(i / 64);
+                i += span;
+            }
+        }
+
+        void markUsed(int index)
+        {
+            assign(index, 1, true);
+        }
+
+        void markFree(int index)
+        {
+            assign(index, 1, false);
+        }
+
+        int findFirstFree() const
+        {
+            int index = 0;
+            for (int level = (int)levels.size() - 1; level >= 0; level--)
+            {
+                uint64_t word = levels[level][index];
+                if (word == 0)
+                    return -1;
+                index = index * 64 + __builtin_ctzll(word);
+            }
+            return index;
+        }
+    };
+
+    class ShareCounts
+    {
+    private:
+        struct Span
+        {
+            int end;
+            uint32_t extra;
+        };
+
+        map<int, Span> spans;
+
+        void split(int at)
+        {
+            auto it = spans.upper_bound(at);
+            if (it == spans.begin())
+                return;
+            --it;
+            if (it->first < at && it->second.end > at)
+            {
+                spans.emplace_hint(std::next(it), at, Span{it->second.end, it->second.extra});
+                it->second.end = at;
+            }
+        }
+
+        void merge(int start, int end)
+        {
+            auto it = spans.lower_bound(start);
+            if (it != spans.begin())
+                --it;
+            while (it != spans.end() && it->first <= end)
+            {
+                auto next = std::next(it);
+                if (next != spans.end() && it->second.end == next->first && it->second.extra == next->second.extra)
+                {
+                    it->second.end = next->second.end;
+                    spans.erase(next);
+                }
+                else
+                    it = next;
+            }
+        }
+
+    public:
+        bool empty() const
+        {
+            return spans.empty();
+        }
+
+        void clear()
+        {
+            spans.clear();
+        }
+
+        void add(int start, int length, uint32_t amount)
+        {
+            int end = start + length;
+            split(start);
+            split(end);
+
+            int cursor = start;
+            auto it = spans.lower_bound(start);
+            while (cursor < end)
+            {
+                if (it == spans.end() || it->first > cursor)
+                {
+                    int gapEnd = (it == spans.end()) ? end : min(end, it->first);
+                    spans.emplace_hint(it, cursor, Span{gapEnd, amount});
+                    cursor = gapEnd;
+                    continue;
+                }
+                it->second.extra += amount;
+                cursor = it->second.end;
+                ++it;
+            }
+            merge(start, end);
+        }
+
+        template <typename Release>
+        void drop(int start, int length, Release release)
+        {
+            int end = start + length;
+            split(start);
+            split(end);
+
+            int cursor = start;
+            auto it = spans.lower_bound(start);
+            while (cursor < end)
+            {
+                if (it == spans.end() || it->first > cursor)
+                {
+                    int gapEnd = (it == spans.end()) ? end : min(end, it->first);
+                    release(cursor, gapEnd - cursor);
+                    cursor = gapEnd;
+                    continue;
+                }
+                cursor = it->second.end;
+                if (--it->second.extra == 0)
+                    it = spans.erase(it);
+                else
+                    ++it;
+            }
+            merge(start, end);
+        }
+
+        template <typename Visit>
+        void forEach(int start, int length, Visit visit) const
+        {
+            int end = start + length;
+            int cursor = start;
+            auto it = spans.upper_bound(start);
+            if (it != spans.begin() && std::prev(it)->second.end > start)
+                --it;
+
+            while (cursor < end)
+            {
+                if (it == spans.end() || it->first >= end)
+                {
+                    visit(cursor, end - cursor, 0);
+                    return;
+                }
+                if (it->first > cursor)
+                {
+                    visit(cursor, it->first - cursor, 0);
+                    cursor = it->first;
+                }
+                int spanEnd = min(end, it->second.end);
+                visit(cursor, spanEnd - cursor, it->second.extra);
+                cursor = spanEnd;
+                ++it;
+            }
+        }
+    };
+
+    class TailStore
+    {
+    private:
+        static_assert(SECTOR_SIZE == 64, "pack occupancy is one bit per byte of a 64-bit word");
+
+        unordered_map<int, uint64_t> packs;
+        vector<set<int>> byGap = vector<set<int>>(SECTOR_SIZE);
+        unordered_map<int64_t, uint32_t> extra;
+
+        static int64_t key(const Tail &tail)
+        {
+            return int64_t(tail.sector) * SECTOR_SIZE + tail.offset;
+        }
+
+        static uint64_t bits(int offset, int length)
+        {
+            uint64_t span = (length == SECTOR_SIZE) ? ~uint64_t(0) : ((uint64_t(1) << length) - 1);
+            return span << offset;
+        }
+
+        static int longestGap(uint64_t used)
+        {
+            int longest = 0, run = 0;
+            for (int byte = 0; byte < SECTOR_SIZE; byte++)
+            {
+                run = (used >> byte & 1) ? 0 : run + 1;
+                longest = max(longest, run);
+            }
+            return longest;
+        }
+
+        static int findGap(uint64_t used, int length)
+        {
+            int run = 0;
+            for (int byte = 0; byte < SECTOR_SIZE; byte++)
+            {
+                run = (used >> byte & 1) ? 0 : run + 1;
+                if (run == length)
+                    return byte - length + 1;
+            }
+            return -1;
+        }
+
+        void refile(int sector, uint64_t before, uint64_t after)
+        {
+            int oldGap = longestGap(before), newGap = longestGap(after);
+            if (before != 0 && oldGap < SECTOR_SIZE && oldGap > 0)
+                byGap[oldGap].erase(sector);
+            if (after != 0 && newGap < SECTOR_SIZE && newGap > 0)
+                byGap[newGap].insert(sector);
+        }
+
+    public:
+        size_t packCount() const
+        {
+            return packs.size();
+        }
+
+        void clear()
+        {
+            packs.clear();
+            extra.clear();
+            for (set<int> &bucket : byGap)
+                bucket.clear();
+        }
+
+        void claim(const Tail &tail)
+        {
+            uint64_t &used = packs[tail.sector];
+            uint64_t before = used;
+            used |= bits(tail.offset, tail.length);
+            refile(tail.sector, before, used);
+        }
+
+        bool place(int length, Tail &tail)
+        {
+            for (int gap = length; gap < SECTOR_SIZE; gap++)
+            {
+                if (byGap[gap].empty())
+                    continue;
+
+                int sector = *byGap[gap].begin();
+                tail = {sector, uint8_t(findGap(packs[sector], length)), uint8_t(length)};
+                claim(tail);
+                return true;
+            }
+            return false;
+        }
+
+        void share(const Tail &tail)
+        {
+            extra[key(tail)]++;
+        }
+
+        bool lastInPack(const Tail &tail) const
+        {
+            if (tail.length == 0 || extra.count(key(tail)))
+                return false;
+            auto pack = packs.find(tail.sector);
+            return pack != packs.end() && pack->second == bits(tail.offset, tail.length);
+        }
+
+        bool release(const Tail &tail)
+        {
+            auto shared = extra.find(key(tail));
+            if (shared != extra.end())
+            {
+                if (--shared->second == 0)
+                    extra.erase(shared);
+                return false;
+            }
+
+            auto pack = packs.find(tail.sector);
+            uint64_t before = pack->second;
+            pack->second &= ~bits(tail.offset, tail.length);
+            refile(tail.sector, before, pack->second);
+            if (pack->second != 0)
+                return false;
+            packs.erase(pack);
+            return true;
+        }
+    };
+
+    class LzCodec
+    {
+    private:
+        static constexpr int MIN_MATCH = 4;
+        static constexpr int HASH_BITS = 12;
+
+        static void putLength(string &output, size_t value)
+        {
+            while (value >= 255)
+            {
+                output += char(255);
+                value -= 255;
+            }
+            output += char(value);
+        }
+
+        static bool getLength(const unsigned char *&in, const unsigned char *end, size_t &value)
+        {
+            unsigned char byte;
+            do
+            {
+                if (in == end)
+                    return false;
+                byte = *in++;
+                value += byte;
+            } while (byte == 255);
+            return true;
+        }
+
+        static void putSequence(string &output, const char *literals, size_t count, size_t offset, size_t match)
+        {
+            size_t matchCode = match ? match - MIN_MATCH : 0;
+            output += char((min(count, size_t(15)) << 4) | min(matchCode, size_t(15)));
+            if (count >= 15)
+                putLength(output, count - 15);
+            output.append(literals, count);
+            if (match == 0)
+                return;
+
+            output += char(offset & 0xFF);
+            output += char(offset >> 8);
+            if (matchCode >= 15)
+                putLength(output, matchCode - 15);
+        }
+
+    public:
+        static void compress(const char *input, size_t size, string &output)
+        {
+            vector<int> table(size_t(1) << HASH_BITS, -1);
+            output.clear();
+
+            size_t anchor = 0, pos = 0;
+            while (pos + MIN_MATCH <= size)
+            {
+                uint32_t sequence;
+                memcpy(&sequence, input + pos, sizeof(sequence));
+                uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+                int candidate = table[hash];
+                table[hash] = pos;
+                if (candidate < 0 || pos - candidate > 0xFFFF || memcmp(input + candidate, input + pos, MIN_MATCH) != 0)
+                {
+                    pos++;
+                    continue;
+                }
+
+                size_t match = MIN_MATCH;
+                while (pos + match < size && input[candidate + match] == input[pos + match])
+                    match++;
+                putSequence(output, input + anchor, pos - anchor, pos - candidate, match);
+                pos += match;
+                anchor = pos;
+            }
+            putSequence(output, input + anchor, size - anchor, 0, 0);
+        }
+
+        static bool decompress(const char *input, size_t inputSize, char *output, size_t outputSize)
+        {
+            const unsigned char *in = reinterpret_cast<const unsigned char *>(input);
+            const unsigned char *end = in + inputSize;
+            size_t produced = 0;
+            while (produced < outputSize)
+            {
+                if (in == end)
+                    return false;
+                unsigned char token = *in++;
+
+                size_t count = token >> 4;
+                if (count == 15 && !getLength(in, end, count))
+                    return false;
+                if (count > size_t(end - in) || count > outputSize - produced)
+                    return false;
+                memcpy(output + produced, in, count);
+                in += count;
+                produced += count;
+                if (produced == outputSize)
+                    break;
+
+                if (end - in < 2)
+                    return false;
+                size_t offset = in[0] | (size_t(in[1]) << 8);
+                in += 2;
+                size_t match = token & 15;
+                if (match == 15 && !getLength(in, end, match))
+                    return false;
+                match += MIN_MATCH;
+                if (offset == 0 || offset > produced || match > outputSize - produced)
+                    return false;
+                for (size_t i = 0; i < match; i++, produced++)
+                    output[produced] = output[produced - offset];
+            }
+            return true;
+        }
+    };
+
+    class BlockCache
+    {
+    private:
+        typedef pair<int, shared_ptr<string>> Entry;
+
+        list<Entry> order;
+        map<int, list<Entry>::iterator> entries;
+        size_t capacity;
+
+    public:
+        explicit BlockCache(size_t capacity) : capacity(capacity)
+        {
+        }
+
+        shared_ptr<string> lookup(int start)
+        {
+            auto it = entries.find(start);
+            if (it == entries.end())
+                return nullptr;
+            order.splice(order.begin(), order, it->second);
+            return it->second->second;
+        }
+
+        void store(int start, shared_ptr<string> block)
+        {
+            order.emplace_front(start, move(block));
+            entries[start] = order.begin();
+            if (order.size() > capacity)
+            {
+                entries.erase(order.back().first);
+                order.pop_back();
+            }
+        }
+
+        void invalidate(int start, int length)
+        {
+            auto it = entries.lower_bound(start);
+            while (it != entries.end() && it->first < start + length)
+            {
+                order.erase(it->second);
+                it = entries.erase(it);
+            }
+        }
+
+        void clear()
+        {
+            order.clear();
+            entries.clear();
+        }
+    };
+
+    class DiskArena
+    {
+    private:
+        char *base = nullptr;
+        size_t mappedBytes = 0;
+
+    public:
+        explicit DiskArena(size_t bytes)
+        {
+            if (bytes == 0)
+                return;
+
+            const size_t hugePage = size_t(2) << 20;
+            size_t hugeBytes = (bytes + hugePage - 1) / hugePage * hugePage;
+            void *memory = mmap(nullptr, hugeBytes, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (memory != MAP_FAILED)
+                mappedBytes = hugeBytes;
+            else
+            {
+                memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (memory == MAP_FAILED)
+                    throw runtime_error("Cannot allocate disk of " + to_string(bytes) + " bytes");
+                mappedBytes = bytes;
+#ifdef MADV_HUGEPAGE
+                madvise(memory, mappedBytes, MADV_HUGEPAGE);
+#endif
+            }
+            base = static_cast<char *>(memory);
+        }
+
+        DiskArena(const DiskArena &) = delete;
+        DiskArena &operator=(const DiskArena &) = delete;
+
+        ~DiskArena()
+        {
+            if (base)
+                munmap(base, mappedBytes);
+        }
+
+        char *sector(int index)
+        {
+            return base + size_t(index) * SECTOR_SIZE;
+        }
+    };
+
+    class HostFile
+    {
+    private:
+        int fd;
+
+    public:
+        HostFile(const string &path, int flags, mode_t mode = 0644) : fd(open(path.c_str(), flags, mode))
+        {
+        }
+
+        HostFile(const HostFile &) = delete;
+        HostFile &operator=(const HostFile &) = delete;
+
+        ~HostFile()
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+
+        bool isOpen() const
+        {
+            return fd >= 0;
+        }
+
+        int descriptor() const
+        {
+            return fd;
+        }
+    };
+
+    class SectorReader
+    {
+    private:
+        const vector<Extent> &extents;
+        size_t remaining;
+        size_t index = 0;
+
+    public:
+        SectorReader(const vector<Extent> &extents, size_t size)
+            : extents(extents), remaining(size)
+        {
+        }
+
+        bool next(const Extent *&run, size_t &length)
+        {
+            if (remaining == 0 || index >= extents.size())
+                return false;
+
+            run = &extents[index++];
+            length = min(remaining, size_t(logicalLength(*run)) * SECTOR_SIZE);
+            remaining -= length;
+            return true;
+        }
+    };
+
+    struct PendingTree
+    {
+        Inode top;
+        uint32_t unlinked;
+        size_t items;
+        size_t sectors;
+    };
+
+    struct ChildChange
+    {
+        uint32_t stamp;
+        Inode before; // what the name held before this change; NO_INODE if it was free
+    };
+
+    typedef map<string, vector<ChildChange>, less<>> ChildLog;
+
+    struct Version
+    {
+        uint32_t from;
+        uint32_t until;
+        uint8_t type;
+        uint64_t size;
+        vector<Extent> extents;
+        string inlined;
+        Tail tail;
+        vector<pair<string, Inode>> children;
+        ChildLog changes;
+    };
+
+    struct FileData
+    {
+        const vector<Extent> *extents;
+        const string *inlined;
+        Tail tail;
+        size_t size;
+    };
+
+    DiskArena disk;
+    SectorBitmap sectorMap;
+    FreeExtents freeExtents;
+    ShareCounts shares;
+    TailStore tailStore;
+    BlockCache blockCache{BLOCK_CACHE_SIZE};
+    DentryCache dentries{DENTRY_CACHE_SIZE};
+    vector<Inode> walked;
+    InodeTable inodes;
+    Inode root;
+    Inode currentDir;
+    int totalSectors;
+    size_t inlineLimit = INLINE_DATA_LIMIT;
+    bool tailPacking = false;
+    bool compression = false;
+    deque<PendingTree> pendingTrees;
+    map<uint32_t, string> snapshots;
+    unordered_map<Inode, vector<Version>> history;
+    unordered_map<Inode, ChildLog> childLogs;
+    Inode reclaimCursor = NO_INODE;
+    Inode countCursor = NO_INODE;
+    size_t countedTrees = 0;
+    size_t pendingItems = 0;
+    size_t pendingSectors = 0;
+    vector<Extent> reclaimRuns;
+    mutex stateLock;
+    condition_variable reclaimWake;
+    bool stopping = false;
+    thread reclaimer;
+
+    void reserveSectors(int count)
+    {
+        if (count > freeExtents.available() && !pendingTrees.empty())
+            reclaimAll();
+        if (count > freeExtents.available())
+            throw runtime_error("No free sectors available");
+    }
+
+    int allocateSector()
+    {
+        int sector = sectorMap.findFirstFree();
+        if (sector < 0)
+            throw runtime_error("No free sectors available");
+
+        sectorMap.markUsed(sector);
+        freeExtents.claim(sector, 1);
+        return sector;
+    }
+
+    void freeRun(const Extent &run)
+    {
+        if (run.start < 0 || run.length < 0 || run.start + run.length > sectorMap.size())
+        {
+            throw out_of_range("Invalid sector run: " + to_string(run.start) + "+" + to_string(run.length) +
+                               ". Valid range: 0 to " + to_string(sectorMap.size() - 1));
+        }
+        sectorMap.assign(run.start, run.length, false);
+        freeExtents.release(run.start, run.length);
+        blockCache.invalidate(run.start, run.length);
+    }
+
+    vector<Extent> allocateRun(int count)
+    {
+        reserveSectors(count);
+        if (count == 1)
+            return {{allocateSector(), 1}};
+
+        vector<Extent> runs;
+        while (count > 0)
+        {
+            int start = freeExtents.takeRun(count);
+            Extent run = (start >= 0) ? Extent{start, count} : freeExtents.takeLargest(count);
+
+            sectorMap.assign(run.start, run.length, true);
+            runs.push_back(run);
+            count -= run.length;
+        }
+        return runs;
+    }
+
+    static int sectorsFor(size_t bytes)
+    {
+        return (bytes + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    }
+
+    static int logicalLength(const Extent &run)
+    {
+        return run.logical ? run.logical : run.length;
+    }
+
+    static void appendRun(vector<Extent> &runs, const Extent &run)
+    {
+        if (!runs.empty() && !runs.back().logical && !run.logical && runs.back().start + runs.back().length == run.start)
+            runs.back().length += run.length;
+        else
+            runs.push_back(run);
+    }
+
+    void releaseRun(const Extent &run)
+    {
+        shares.drop(run.start, run.length, [this](int start, int length)
+                    { freeRun({start, length}); });
+    }
+
+    void privatize(Inode file, size_t offset, size_t length)
+    {
+        if (shares.empty() || length == 0)
+            return;
+
+        int first = offset / SECTOR_SIZE;
+        int last = sectorsFor(offset + length);
+        auto eachPiece = [&](auto visit)
+        {
+            int logical = 0;
+            for (const Extent &run : inodes.extents[file])
+            {
+                int lo = max(first - logical, 0);
+                int hi = min(last - logical, logicalLength(run));
+                visit(run, lo, hi);
+                logical += logicalLength(run);
+            }
+        };
+
+        int sharedCount = 0;
+        eachPiece([&](const Extent &run, int lo, int hi)
+                  {
+                      if (lo < hi)
+                          shares.forEach(run.start + lo, hi - lo, [&](int, int count, uint32_t extra)
+                                         { sharedCount += (extra > 0) ? count : 0; });
+                  });
+        if (sharedCount == 0)
+            return;
+        reserveSectors(sharedCount);
+
+        vector<Extent> rebuilt;
+        vector<Extent> detached;
+        eachPiece([&](const Extent &run, int lo, int hi)
+                  {
+                      if (lo >= hi)
+                      {
+                          appendRun(rebuilt, run);
+                          return;
+                      }
+                      if (lo > 0)
+                          appendRun(rebuilt, {run.start, lo});
+                      shares.forEach(run.start + lo, hi - lo, [&](int start, int count, uint32_t extra)
+                                     {
+                                         if (extra == 0)
+                                         {
+                                             appendRun(rebuilt, {start, count});
+                                             return;
+                                         }
+                                         detached.push_back({start, count});
+                                         for (const Extent &copy : allocateRun(count))
+                                         {
+                                             memcpy(disk.sector(copy.start), disk.sector(start), size_t(copy.length) * SECTOR_SIZE);
+                                             appendRun(rebuilt, copy);
+                                             start += copy.length;
+                                         }
+                                     });
+                      if (hi < run.length)
+                          appendRun(rebuilt, {run.start + hi, run.length - hi});
+                  });
+
+        inodes.extents[file].swap(rebuilt);
+        for (const Extent &run : detached)
+            releaseRun(run);
+    }
+
+    void truncateFile(Inode file, int keep)
+    {
+        expandRange(file, keep, keep);
+
+        vector<Extent> kept;
+        int seen = 0;
+        for (const Extent &run : inodes.extents[file])
+        {
+            int span = logicalLength(run);
+            int cut = max(0, min(span, keep - seen));
+            if (cut == span)
+                kept.push_back(run);
+            else
+            {
+                if (cut > 0)
+                    kept.push_back({run.start, cut});
+                releaseRun({run.start + cut, run.length - cut});
+            }
+            seen += span;
+        }
+        inodes.extents[file] = kept;
+    }
+
+    shared_ptr<string> decodedBlock(const Extent &run)
+    {
+        shared_ptr<string> block = blockCache.lookup(run.start);
+        if (block)
+            return block;
+
+        block = make_shared<string>(size_t(run.logical) * SECTOR_SIZE, '\0');
+        if (!LzCodec::decompress(disk.sector(run.start), size_t(run.length) * SECTOR_SIZE, &(*block)[0], block->size()))
+            throw runtime_error("Corrupt compressed block at sector " + to_string(run.start));
+        blockCache.store(run.start, block);
+        return block;
+    }
+
+    void expandRange(Inode file, int first, int last)
+    {
+        int needed = 0, logical = 0;
+        for (const Extent &run : inodes.extents[file])
+        {
+            if (run.logical && logical < last && logical + run.logical > first)
+                needed += run.logical;
+            logical += logicalLength(run);
+        }
+        if (needed == 0)
+            return;
+        reserveSectors(needed);
+
+        vector<Extent> rebuilt;
+        vector<Extent> expanded;
+        logical = 0;
+        for (const Extent &run : inodes.extents[file])
+        {
+            int span = logicalLength(run);
+            if (run.logical && logical < last && logical + span > first)
+            {
+                shared_ptr<string> block = decodedBlock(run);
+                const char *source = block->data();
+                for (const Extent &piece : allocateRun(run.logical))
+                {
+                    memcpy(disk.sector(piece.start), source, size_t(piece.length) * SECTOR_SIZE);
+                    source += size_t(piece.length) * SECTOR_SIZE;
+                    appendRun(rebuilt, piece);
+                }
+                expanded.push_back(run);
+            }
+            else
+                appendRun(rebuilt, run);
+            logical += span;
+        }
+
+        inodes.extents[file].swap(rebuilt);
+        for (const Extent &run : expanded)
+            releaseRun(run);
+    }
+
+    bool storeBlock(const char *raw, string &packed, Extent &run)
+    {
+        const int block = COMPRESS_BLOCK_SECTORS;
+        LzCodec::compress(raw, size_t(block) * SECTOR_SIZE, packed);
+        int count = sectorsFor(packed.size());
+        int start = (count < block) ? freeExtents.takeRun(count) : -1;
+        if (start < 0)
+            return false;
+
+        sectorMap.assign(start, count, true);
+        for (int sector = 0; sector < count; sector++)
+        {
+            size_t at = size_t(sector) * SECTOR_SIZE;
+            memcpy(disk.sector(start + sector), packed.data() + at, min(size_t(SECTOR_SIZE), packed.size() - at));
+        }
+        run = {start, count, block};
+        return true;
+    }
+
+    void compressRange(Inode file, int first, int last)
+    {
+        const int block = COMPRESS_BLOCK_SECTORS;
+        int fullBlocks = inodes.size[file] / (size_t(block) * SECTOR_SIZE) * block;
+        first = first / block * block;
+        last = min((last + block - 1) / block * block, fullBlocks);
+        if (!compression || first >= last)
+            return;
+
+        vector<Extent> rebuilt;
+        vector<Extent> replaced;
+        vector<Extent> pending;
+        string raw(size_t(block) * SECTOR_SIZE, '\0');
+        string packed;
+        int logical = 0;
+        for (const Extent &run : inodes.extents[file])
+        {
+            if (run.logical || logical + run.length <= first || logical >= last)
+            {
+                appendRun(rebuilt, run);
+                logical += logicalLength(run);
+                continue;
+            }
+
+            for (int offset = 0; offset < run.length;)
+            {
+                int position = logical + offset;
+                int blockEnd = position / block * block + block;
+                Extent piece{run.start + offset, min(run.length - offset, blockEnd - position)};
+                offset += piece.length;
+                if (position < first || position >= last)
+                {
+                    appendRun(rebuilt, piece);
+                    continue;
+                }
+
+                pending.push_back(piece);
+                if (position + piece.length < blockEnd)
+                    continue;
+
+                size_t pos = 0;
+                bool shared = false;
+                for (const Extent &part : pending)
+                {
+                    memcpy(&raw[pos], disk.sector(part.start), size_t(part.length) * SECTOR_SIZE);
+                    pos += size_t(part.length) * SECTOR_SIZE;
+                    shares.forEach(part.start, part.length, [&](int, int, uint32_t extra)
+                                   { shared = shared || extra > 0; });
+                }
+                Extent compressed;
+                if (!shared && storeBlock(raw.data(), packed, compressed))
+                {
+                    rebuilt.push_back(compressed);
+                    replaced.insert(replaced.end(), pending.begin(), pending.end());
+                }
+                else
+                {
+                    for (const Extent &part : pending)
+                        appendRun(rebuilt, part);
+                }
+                pending.clear();
+            }
+            logical += run.length;
+        }
+
+        inodes.extents[file].swap(rebuilt);
+        for (const Extent &run : replaced)
+            releaseRun(run);
+    }
+
+    void promoteInline(Inode file)
+    {
+        string &inlined = inodes.inlineData[file];
+        if (inlined.empty())
+            return;
+
+        inodes.extents[file] = allocateRun(sectorsFor(inlined.size()));
+        size_t pos = 0;
+        for (const Extent &run : inodes.extents[file])
+        {
+            size_t len = min(size_t(run.length) * SECTOR_SIZE, inlined.size() - pos);
+            memcpy(disk.sector(run.start), inlined.data() + pos, len);
+            pos += len;
+        }
+        string().swap(inlined);
+    }
+
+    void releaseTail(const Tail &tail)
+    {
+        if (tail.length > 0 && tailStore.release(tail))
+            freeRun({tail.sector, 1});
+    }
+
+    void dropTail(Inode file)
+    {
+        Tail &tail = inodes.tails[file];
+        releaseTail(tail);
+        inodes.size[file] -= tail.length;
+        tail = Tail();
+    }
+
+    void packTail(Inode file)
+    {
+        size_t partial = inodes.size[file] % SECTOR_SIZE;
+        vector<Extent> &extents = inodes.extents[file];
+        if (!tailPacking || partial == 0 || extents.empty() || extents.back().logical || inodes.tails[file].length > 0)
+            return;
+
+        Extent &last = extents.back();
+        int sector = last.start + last.length - 1;
+        Tail tail;
+        if (tailStore.place(partial, tail))
+        {
+            memcpy(disk.sector(tail.sector) + tail.offset, disk.sector(sector), partial);
+            releaseRun({sector, 1});
+        }
+        else
+        {
+            bool shared = false;
+            shares.forEach(sector, 1, [&](int, int, uint32_t count)
+                           { shared = count > 0; });
+            if (shared)
+                return;
+            tail = {sector, 0, uint8_t(partial)};
+            tailStore.claim(tail);
+        }
+
+        if (--last.length == 0)
+            extents.pop_back();
+        inodes.tails[file] = tail;
+    }
+
+    void unpackTail(Inode file)
+    {
+        Tail tail = inodes.tails[file];
+        if (tail.length == 0)
+            return;
+
+        extendFile(file, 1);
+        const Extent &last = inodes.extents[file].back();
+        memcpy(disk.sector(last.start + last.length - 1), disk.sector(tail.sector) + tail.offset, tail.length);
+        releaseTail(tail);
+        inodes.tails[file] = Tail();
+    }
+
+    void extendFile(Inode file, int count)
+    {
+        reserveSectors(count);
+
+        if (!inodes.extents[file].empty() && !inodes.extents[file].back().logical)
+        {
+            Extent &last = inodes.extents[file].back();
+            int end = last.start + last.length;
+            int taken = freeExtents.takeAt(end, count);
+            if (taken > 0)
+            {
+                sectorMap.assign(end, taken, true);
+                last.length += taken;
+                count -= taken;
+            }
+        }
+
+        if (count > 0)
+        {
+            for (const Extent &run : allocateRun(count))
+                inodes.extents[file].push_back(run);
+        }
+    }
+
+    // Live folders record child changes in childLogs, so a folder is only preserved when it is reclaimed.
+    void preserve(Inode node, uint32_t until)
+    {
+        ChildLog changes;
+        auto log = childLogs.find(node);
+        if (log != childLogs.end())
+        {
+            changes = move(log->second);
+            childLogs.erase(log);
+        }
+
+        uint32_t from = inodes.epoch[node];
+        auto seen = snapshots.lower_bound(from);
+        if (seen == snapshots.end() || seen->first >= until)
+            return;
+
+        Version version{from, until, inodes.type[node], inodes.size[node], inodes.extents[node], inodes.inlineData[node],
+                        inodes.tails[node], {}, move(changes)};
+        for (const Extent &run : version.extents)
+            shares.add(run.start, run.length, 1);
+        if (version.tail.length > 0)
+            tailStore.share(version.tail);
+        if (inodes.isFolder(node))
+        {
+            inodes.listChildren(node, "", "", SIZE_MAX, [&](Inode child)
+                                { version.children.emplace_back(string(inodes.name(child)), child); });
+        }
+
+        history[node].push_back(move(version));
+        inodes.epoch[node] = until;
+    }
+
+    void logChange(Inode dir, string_view name, Inode before)
+    {
+        if (snapshots.lower_bound(inodes.epoch[dir]) == snapshots.end())
+            return;
+
+        ChildLog &log = childLogs[dir];
+        auto entry = log.find(name);
+        if (entry == log.end())
+            entry = log.emplace(string(name), vector<ChildChange>()).first;
+        if (entry->second.empty() || entry->second.back().stamp != inodes.now)
+            entry->second.push_back({inodes.now, before});
+    }
+
+    // Changes at or before the oldest snapshot that can see the folder are never consulted again.
+    static void pruneLog(ChildLog &log, uint32_t oldest)
+    {
+        for (auto entry = log.begin(); entry != log.end();)
+        {
+            vector<ChildChange> &changes = entry->second;
+            changes.erase(changes.begin(), upper_bound(changes.begin(), changes.end(), oldest, [](uint32_t stamp, const ChildChange &change)
+                                                       { return stamp < change.stamp; }));
+            entry = changes.empty() ? log.erase(entry) : std::next(entry);
+        }
+    }
+
+    void dropUnusedVersions()
+    {
+        for (auto entry = childLogs.begin(); entry != childLogs.end();)
+        {
+            auto seen = snapshots.lower_bound(inodes.epoch[entry->first]);
+            if (seen != snapshots.end())
+                pruneLog(entry->second, seen->first);
+            entry = (seen == snapshots.end() || entry->second.empty()) ? childLogs.erase(entry) : std::next(entry);
+        }
+
+        for (auto entry = history.begin(); entry != history.end();)
+        {
+            vector<Version> &versions = entry->second;
+            auto kept = remove_if(versions.begin(), versions.end(), [this](const Version &version)
+                                  {
+                                      auto seen = snapshots.lower_bound(version.from);
+                                      if (seen != snapshots.end() && seen->first < version.until)
+                                          return false;
+                                      for (const Extent &run : version.extents)
+                                          releaseRun(run);
+                                      releaseTail(version.tail);
+                                      return true;
+                                  });
+            versions.erase(kept, versions.end());
+            for (Version &version : versions)
+                pruneLog(version.changes, snapshots.lower_bound(version.from)->first);
+            entry = versions.empty() ? history.erase(entry) : std::next(entry);
+        }
+    }
+
+    template <typename Visit>
+    void forEachRange(const vector<Extent> &extents, size_t offset, size_t length, Visit visit)
+    {
+        for (const Extent &run : extents)
+        {
+            if (length == 0)
+                break;
+
+            size_t runBytes = size_t(logicalLength(run)) * SECTOR_SIZE;
+            if (offset >= runBytes)
+            {
+                offset -= runBytes;
+                continue;
+            }
+
+            size_t len = min(runBytes - offset, length);
+            shared_ptr<string> block = run.logical ? decodedBlock(run) : nullptr;
+            visit((block ? &(*block)[0] : disk.sector(run.start)) + offset, len);
+            length -= len;
+            offset = 0;
+        }
+    }
+
+    void writeAt(Inode file, size_t offset, const string &data)
+    {
+        if (offset > inodes.size[file])
+            throw runtime_error("Offset " + to_string(offset) + " is beyond end of file (" +
+                                to_string(inodes.size[file]) + " bytes)");
+
+        preserve(file, inodes.now);
+        size_t newSize = max(inodes.size[file], offset + data.length());
+        if (inodes.extents[file].empty() && inodes.tails[file].length == 0 && newSize <= inlineLimit)
+        {
+            string &inlined = inodes.inlineData[file];
+            inlined.resize(newSize);
+            inlined.replace(offset, data.length(), data);
+            inodes.size[file] = newSize;
+            return;
+        }
+
+        promoteInline(file);
+        unpackTail(file);
+        int first = offset / SECTOR_SIZE;
+        int last = sectorsFor(offset + data.length());
+        expandRange(file, first, last);
+        privatize(file, offset, data.length());
+        int missing = sectorsFor(newSize) - sectorsFor(inodes.size[file]);
+        if (missing > 0)
+            extendFile(file, missing);
+        inodes.size[file] = newSize;
+
+        const char *source = data.data();
+        forEachRange(inodes.extents[file], offset, data.length(), [&](char *target, size_t len)
+                     {
+                         memcpy(target, source, len);
+                         source += len;
+                     });
+        compressRange(file, first, last);
+        packTail(file);
+    }
+
+    static size_t readHost(int fd, char *target, size_t want)
+    {
+        size_t total = 0;
+        while (total < want)
+        {
+            ssize_t got = ::read(fd, target + total, want - total);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                throw runtime_error(string("Read failed: ") + strerror(errno));
+            if (got == 0)
+                break;
+            total += got;
+        }
+        return total;
+    }
+
+    size_t loadFromHost(int fd, Inode file, size_t size)
     {
-        for (int i = 0; i < sectorMap.size(); i++)
+        if (size <= inlineLimit)
+        {
+            string &inlined = inodes.inlineData[file];
+            inlined.resize(size);
+            inlined.resize(readHost(fd, &inlined[0], size));
+            inodes.size[file] = inlined.size();
+            return inlined.size();
+        }
+
+        if (compression)
         {
-            if (!sectorMap[i])
+            string raw(size_t(COMPRESS_BLOCK_SECTORS) * SECTOR_SIZE, '\0');
+            string packed;
+            size_t loaded = 0;
+            while (loaded < size)
             {
-                sectorMap[i] = true;
-                return i;
+                size_t want = min(raw.size(), size - loaded);
+                size_t got = readHost(fd, &raw[0], want);
+                Extent compressed;
+                if (got == raw.size() && storeBlock(raw.data(), packed, compressed))
+                    inodes.extents[file].push_back(compressed);
+                else
+                {
+                    const char *source = raw.data();
+                    for (const Extent &run : allocateRun(sectorsFor(got)))
+                    {
+                        memcpy(disk.sector(run.start), source, size_t(run.length) * SECTOR_SIZE);
+                        source += size_t(run.length) * SECTOR_SIZE;
+                        appendRun(inodes.extents[file], run);
+                    }
+                }
+                loaded += got;
+                if (got < want)
+                    break;
             }
+
+            inodes.size[file] = loaded;
+            packTail(file);
+            return loaded;
         }
-        throw runtime_error("No free sectors available");
+
+        inodes.extents[file] = allocateRun(sectorsFor(size));
+
+        size_t loaded = 0;
+        for (const Extent &run : inodes.extents[file])
+        {
+            size_t want = min(size_t(run.length) * SECTOR_SIZE, size - loaded);
+            size_t got = readHost(fd, disk.sector(run.start), want);
+            loaded += got;
+            if (got < want)
+                break;
+        }
+
+        truncateFile(file, sectorsFor(loaded));
+        inodes.size[file] = loaded;
+        packTail(file);
+        return loaded;
     }
 
-    void freeSector(int sector)
+    size_t streamFromHost(int fd, Inode file)
     {
-        if (sector < 0 || sector >= sectorMap.size())
+        const size_t chunkBytes = size_t(COMPRESS_BLOCK_SECTORS) * SECTOR_SIZE;
+        string chunk;
+        while (true)
         {
-            throw out_of_range("Invalid sector number: " + to_string(sector) +
-                               ". Valid range: 0 to " + to_string(sectorMap.size() - 1));
+            chunk.resize(chunkBytes);
+            chunk.resize(readHost(fd, &chunk[0], chunkBytes));
+            if (chunk.empty())
+                break;
+            writeAt(file, inodes.size[file], chunk);
+            if (chunk.size() < chunkBytes)
+                break;
         }
-        sectorMap[sector] = false;
+        return inodes.size[file];
     }
 
-    void saveToDisk(Item *file)
+    void exportToHost(int fd, const FileData &file)
     {
-        if (!file || file->isFolder)
-            return;
+        vector<shared_ptr<string>> pinned;
+        vector<iovec> batch;
+        batch.reserve(IOV_MAX);
+        off_t offset = 0;
+
+        auto flush = [&]()
+        {
+            size_t first = 0;
+            while (first < batch.size())
+            {
+                ssize_t written = pwritev(fd, batch.data() + first, min(batch.size() - first, size_t(IOV_MAX)), offset);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written < 0)
+                    throw runtime_error(string("Write failed: ") + strerror(errno));
+
+                offset += written;
+                while (written > 0)
+                {
+                    iovec &head = batch[first];
+                    size_t used = min(size_t(written), head.iov_len);
+                    head.iov_base = static_cast<char *>(head.iov_base) + used;
+                    head.iov_len -= used;
+                    written -= used;
+                    if (head.iov_len == 0)
+                        first++;
+                }
+            }
+            batch.clear();
+            pinned.clear();
+        };
 
-        for (int sector : file->sectors)
-            freeSector(sector);
-        file->sectors.clear();
+        if (file.inlined)
+        {
+            if (file.size > 0)
+            {
+                batch.push_back({const_cast<char *>(file.inlined->data()), file.size});
+                flush();
+            }
+            return;
+        }
 
-        string data = file->content;
-        int pos = 0;
-        while (pos < data.length())
+        SectorReader reader(*file.extents, file.size);
+        const Extent *run;
+        size_t length;
+        while (reader.next(run, length))
         {
-            int sector = allocateSector();
-            file->sectors.push_back(sector);
+            if (run->logical)
+            {
+                pinned.push_back(decodedBlock(*run));
+                batch.push_back({&(*pinned.back())[0], length});
+            }
+            else
+                batch.push_back({disk.sector(run->start), length});
+            if (batch.size() == IOV_MAX)
+                flush();
+        }
+        if (file.tail.length > 0)
+            batch.push_back({disk.sector(file.tail.sector) + file.tail.offset, file.tail.length});
+        flush();
+    }
 
-            while (sector >= disk.size())
-                disk.push_back("");
+    Inode findChild(Inode dir, string_view name)
+    {
+        return inodes.lookup(dir, name);
+    }
 
-            int len = min(SECTOR_SIZE, (int)data.length() - pos);
-            disk[sector] = data.substr(pos, len);
-            pos += len;
+    void addChild(Inode dir, Inode child)
+    {
+        logChange(dir, inodes.name(child), NO_INODE);
+        inodes.link(dir, child);
+    }
+
+    void removeChild(Inode dir, Inode child)
+    {
+        logChange(dir, inodes.name(child), child);
+        inodes.unlink(dir, child);
+    }
+
+    void renameItem(Inode item, string_view name)
+    {
+        Inode dir = inodes.parentOf(item);
+        if (dir != NO_INODE)
+        {
+            logChange(dir, inodes.name(item), item);
+            logChange(dir, name, NO_INODE);
         }
+        inodes.rename(item, name);
     }
 
-    vector<string> splitPath(const string &path)
+    class PathTokenizer
     {
-        vector<string> parts;
-        string part;
-        istringstream stream(path);
+    private:
+        string_view rest;
+
+    public:
+        explicit PathTokenizer(string_view path) : rest(path)
+        {
+        }
 
-        while (getline(stream, part, '/'))
+        bool next(string_view &part)
+        {
+            while (!rest.empty())
+            {
+                size_t slash = rest.find('/');
+                part = rest.substr(0, slash);
+                rest = (slash == string_view::npos) ? string_view() : rest.substr(slash + 1);
+                if (!part.empty())
+                    return true;
+            }
+            return false;
+        }
+    };
+
+    void splitDestination(string_view dest, string_view &dirPath, string_view &name)
+    {
+        size_t lastSlash = dest.find_last_of('/');
+        if (lastSlash == string_view::npos)
         {
-            if (!part.empty())
-                parts.push_back(part);
+            dirPath = ".";
+            name = dest;
         }
-        return parts;
+        else
+        {
+            dirPath = dest.substr(0, max(lastSlash, size_t(1)));
+            name = dest.substr(lastSlash + 1);
+        }
+
+        if (!isValidName(name))
+            throw runtime_error("Invalid destination name: " + string(name));
     }
 
-    Item *getItem(const string &path)
+    Inode getItem(string_view path)
     {
         if (path.empty() || path == ".")
             return currentDir;
         if (path == "/")
             return root;
         if (path == "..")
-            return (currentDir->parent) ? currentDir->parent : currentDir;
+            return (inodes.parentOf(currentDir) != NO_INODE) ? inodes.parentOf(currentDir) : currentDir;
+
+        Inode base = (path[0] == '/') ? root : currentDir;
+        Inode found;
+        if (dentries.lookup(inodes, base, path, found))
+            return found;
+
+        found = resolvePath(base, path, walked);
+        dentries.store(inodes, base, path, found, walked);
+        return found;
+    }
+
+    Inode resolvePath(Inode current, string_view path, vector<Inode> &visited)
+    {
+        visited.assign(1, current);
+        PathTokenizer parts(path);
+        string_view part;
+        while (parts.next(part))
+        {
+            if (part == ".")
+                continue;
+            if (part == "..")
+            {
+                if (inodes.parentOf(current) != NO_INODE)
+                    current = inodes.parentOf(current);
+            }
+            else
+            {
+                if (!inodes.isFolder(current))
+                    return NO_INODE;
+
+                current = findChild(current, part);
+                if (current == NO_INODE)
+                    return NO_INODE;
+            }
+            visited.push_back(current);
+        }
+        return current;
+    }
+
+    const Version *versionAt(Inode node, uint32_t snapshot)
+    {
+        if (inodes.epoch[node] <= snapshot)
+            return nullptr;
 
-        Item *current = currentDir;
-        vector<string> parts;
-        if (path[0] == '/')
+        auto entry = history.find(node);
+        if (entry != history.end())
         {
-            current = root;
-            parts = splitPath(path);
+            for (const Version &version : entry->second)
+            {
+                if (version.from <= snapshot && snapshot < version.until)
+                    return &version;
+            }
         }
-        else
-            parts = splitPath(path);
+        throw runtime_error("Snapshot is missing inode " + to_string(node));
+    }
+
+    bool snapshotIsFolder(Inode node, uint32_t snapshot)
+    {
+        const Version *version = versionAt(node, snapshot);
+        return (version ? version->type : inodes.type[node]) == FOLDER_INODE;
+    }
+
+    const ChildLog &logOf(Inode dir, const Version *version)
+    {
+        static const ChildLog unchanged;
+        if (version)
+            return version->changes;
+        auto log = childLogs.find(dir);
+        return (log != childLogs.end()) ? log->second : unchanged;
+    }
+
+    // The first change after the snapshot tells what a name held then; an unchanged name reads from the base listing.
+    static bool loggedChild(const vector<ChildChange> &changes, uint32_t snapshot, Inode &child)
+    {
+        auto change = upper_bound(changes.begin(), changes.end(), snapshot, [](uint32_t stamp, const ChildChange &entry)
+                                  { return stamp < entry.stamp; });
+        if (change == changes.end())
+            return false;
+        child = change->before;
+        return true;
+    }
+
+    Inode snapshotLookup(Inode dir, uint32_t snapshot, string_view name)
+    {
+        const Version *version = versionAt(dir, snapshot);
+        const ChildLog &log = logOf(dir, version);
+        auto changes = log.find(name);
+        Inode logged;
+        if (changes != log.end() && loggedChild(changes->second, snapshot, logged))
+            return logged;
+        if (!version)
+            return findChild(dir, name);
+
+        auto it = lower_bound(version->children.begin(), version->children.end(), name,
+                              [](const pair<string, Inode> &child, string_view key)
+                              { return child.first < key; });
+        if (it == version->children.end() || it->first != name)
+            return NO_INODE;
+        return it->second;
+    }
+
+    bool findSnapshot(string_view name, uint32_t &id)
+    {
+        for (const auto &snapshot : snapshots)
+        {
+            if (snapshot.second == name)
+            {
+                id = snapshot.first;
+                return true;
+            }
+        }
+        return false;
+    }
 
-        for (const string &part : parts)
+    Inode resolveSnapshotPath(string_view path, uint32_t &snapshot)
+    {
+        size_t slash = path.find('/');
+        string_view name = path.substr(1, slash == string_view::npos ? string_view::npos : slash - 1);
+        if (!findSnapshot(name, snapshot))
+            throw runtime_error("Snapshot not found: " + string(name));
+
+        vector<Inode> trail{root};
+        PathTokenizer parts(slash == string_view::npos ? string_view() : path.substr(slash));
+        string_view part;
+        while (parts.next(part))
         {
             if (part == ".")
                 continue;
             if (part == "..")
             {
-                if (current->parent)
-                    current = current->parent;
+                if (trail.size() > 1)
+                    trail.pop_back();
                 continue;
             }
+            if (!snapshotIsFolder(trail.back(), snapshot))
+                return NO_INODE;
+
+            Inode next = snapshotLookup(trail.back(), snapshot, part);
+            if (next == NO_INODE)
+                return NO_INODE;
+            trail.push_back(next);
+        }
+        return trail.back();
+    }
+
+    template <typename Visit>
+    void listSnapshotChildren(Inode dir, uint32_t snapshot, string_view after, string_view prefix, size_t limit, Visit visit)
+    {
+        const Version *version = versionAt(dir, snapshot);
+        const ChildLog &log = logOf(dir, version);
+        auto change = log.lower_bound(prefix);
+        if (!after.empty() && after >= prefix)
+            change = log.upper_bound(after);
 
-            bool found = false;
-            for (Item *child : current->children)
+        auto emit = [&](string_view name, Inode child)
+        {
+            if (child != NO_INODE && limit > 0)
             {
-                if (child->name == part)
+                visit(name, child);
+                limit--;
+            }
+        };
+        auto emitChanged = [&](string_view below, bool toEnd)
+        {
+            Inode logged;
+            for (; change != log.end() && (toEnd || change->first < below); ++change)
+            {
+                if (change->first.compare(0, prefix.size(), prefix) != 0)
                 {
-                    current = child;
-                    found = true;
-                    break;
+                    change = log.end();
+                    return;
                 }
+                if (loggedChild(change->second, snapshot, logged))
+                    emit(change->first, logged);
             }
-            if (!found)
-                return nullptr;
+        };
+        auto emitBase = [&](string_view name, Inode child)
+        {
+            emitChanged(name, false);
+            if (change != log.end() && change->first == name)
+            {
+                loggedChild(change->second, snapshot, child);
+                ++change;
+            }
+            emit(name, child);
+        };
+
+        // Every changed name can hide at most one base entry, so the base never needs more than limit + log size.
+        size_t baseLimit = (limit > SIZE_MAX - log.size()) ? SIZE_MAX : limit + log.size();
+        if (!version)
+        {
+            inodes.listChildren(dir, after, prefix, baseLimit, [&](Inode child)
+                                { emitBase(inodes.name(child), child); });
         }
-        return current;
+        else
+        {
+            auto byName = [](const pair<string, Inode> &child, string_view key)
+            { return child.first < key; };
+            auto it = lower_bound(version->children.begin(), version->children.end(), prefix, byName);
+            if (!after.empty() && after >= prefix)
+            {
+                it = lower_bound(version->children.begin(), version->children.end(), after, byName);
+                if (it != version->children.end() && it->first == after)
+                    ++it;
+            }
+            for (; it != version->children.end() && baseLimit > 0; ++it, baseLimit--)
+            {
+                if (it->first.compare(0, prefix.size(), prefix) != 0)
+                    break;
+                emitBase(it->first, it->second);
+            }
+        }
+        if (limit > 0)
+            emitChanged("", true);
     }
 
-    void collectAllFiles(Item *folder, vector<Item *> &files)
+    void collectAllFiles(vector<Inode> &files)
     {
-        for (Item *child : folder->children)
+        for (Inode inode = 0; inode < inodes.count(); inode++)
         {
-            if (child->isFolder)
-                collectAllFiles(child, files);
-            else
-                files.push_back(child);
+            if (inodes.type[inode] == FILE_INODE)
+                files.push_back(inode);
         }
     }
 
-    bool isValidName(const string &name)
+    bool isValidName(string_view name)
     {
         if (name.empty() || name == "." || name == "..")
             return false;
@@ -160,15 +2781,15 @@ private:
         return true;
     }
 
-    string getFullPath(Item *item)
+    string getFullPath(Inode item)
     {
         if (item == root)
             return "/";
 
-        vector<string> pathParts;
+        vector<string_view> pathParts;
 
-        for (Item *current = item; current != root; current = current->parent)
-            pathParts.push_back(current->name);
+        for (Inode current = item; current != root; current = inodes.parentOf(current))
+            pathParts.push_back(inodes.name(current));
 
         reverse(pathParts.begin(), pathParts.end());
 
@@ -183,89 +2804,635 @@ private:
         return fullPath;
     }
 
-    void freeSectorsRecursive(Item *item)
+    void releaseRuns(vector<Extent> &runs)
+    {
+        sort(runs.begin(), runs.end(), [](const Extent &a, const Extent &b)
+             { return a.start < b.start; });
+
+        size_t merged = 0;
+        for (size_t i = 1; i < runs.size(); i++)
+        {
+            Extent &last = runs[merged];
+            if (last.start + last.length == runs[i].start)
+                last.length += runs[i].length;
+            else
+                runs[++merged] = runs[i];
+        }
+        if (!runs.empty())
+            runs.resize(merged + 1);
+
+        for (const Extent &run : runs)
+            releaseRun(run);
+        runs.clear();
+    }
+
+    void deleteTree(Inode top)
     {
-        if (!item)
+        if (top == NO_INODE)
             return;
 
-        if (!item->isFolder)
+        pendingTrees.push_back({top, inodes.now, 0, 0});
+        reclaimWake.notify_one();
+    }
+
+    void reclaimStep(size_t budget)
+    {
+        while (budget > 0 && countedTrees > 0)
+        {
+            PendingTree &pending = pendingTrees.front();
+            Inode top = pending.top;
+            uint32_t unlinked = pending.unlinked;
+            Inode node = (reclaimCursor != NO_INODE) ? reclaimCursor : top;
+            reclaimCursor = NO_INODE;
+
+            while (true)
+            {
+                preserve(node, unlinked);
+                while (inodes.firstChildOf(node) != NO_INODE)
+                {
+                    node = inodes.firstChildOf(node);
+                    preserve(node, unlinked);
+                }
+
+                size_t freed = min(pending.sectors, reclaimableSectors(node, unlinked));
+                pending.items--;
+                pending.sectors -= freed;
+                pendingItems--;
+                pendingSectors -= freed;
+
+                for (const Extent &run : inodes.extents[node])
+                    reclaimRuns.push_back(run);
+                const Tail &tail = inodes.tails[node];
+                if (tail.length > 0 && tailStore.release(tail))
+                    reclaimRuns.push_back({tail.sector, 1});
+                if (reclaimRuns.size() >= RECLAIM_BATCH)
+                    releaseRuns(reclaimRuns);
+
+                if (node == top)
+                {
+                    inodes.destroy(node);
+                    pendingItems -= pending.items;
+                    pendingSectors -= pending.sectors;
+                    countedTrees--;
+                    pendingTrees.pop_front();
+                    break;
+                }
+
+                Inode up = inodes.parentOf(node);
+                inodes.detachFirstChild(up);
+                inodes.destroy(node);
+                node = up;
+
+                if (--budget == 0)
+                {
+                    reclaimCursor = node;
+                    break;
+                }
+            }
+        }
+        releaseRuns(reclaimRuns);
+    }
+
+    void reclaimAll()
+    {
+        while (!pendingTrees.empty())
+        {
+            countStep(SIZE_MAX);
+            reclaimStep(SIZE_MAX);
+        }
+    }
+
+    void reclaimLoop()
+    {
+        unique_lock<mutex> lock(stateLock);
+        while (true)
+        {
+            reclaimWake.wait(lock, [this]()
+                             { return stopping || !pendingTrees.empty(); });
+            if (stopping)
+                return;
+
+            if (countedTrees < pendingTrees.size())
+                countStep(RECLAIM_BATCH);
+            else
+                reclaimStep(RECLAIM_BATCH);
+            lock.unlock();
+            this_thread::yield();
+            lock.lock();
+        }
+    }
+
+    size_t reclaimableSectors(Inode node, uint32_t unlinked)
+    {
+        auto seen = snapshots.lower_bound(inodes.epoch[node]);
+        if (seen != snapshots.end() && seen->first < unlinked)
+            return 0;
+
+        size_t sectors = 0;
+        for (const Extent &run : inodes.extents[node])
+        {
+            shares.forEach(run.start, run.length, [&](int, int count, uint32_t extra)
+                           { sectors += (extra == 0) ? count : 0; });
+        }
+        if (tailStore.lastInPack(inodes.tails[node]))
+            sectors++;
+        return sectors;
+    }
+
+    // Adds queued trees to the pending totals in bounded batches; reclaimStep only frees trees counted here.
+    void countStep(size_t budget)
+    {
+        while (budget > 0 && countedTrees < pendingTrees.size())
+        {
+            PendingTree &pending = pendingTrees[countedTrees];
+            Inode node = (countCursor != NO_INODE) ? countCursor : pending.top;
+            countCursor = NO_INODE;
+
+            while (node != NO_INODE)
+            {
+                size_t sectors = reclaimableSectors(node, pending.unlinked);
+                pending.items++;
+                pending.sectors += sectors;
+                pendingItems++;
+                pendingSectors += sectors;
+
+                if (inodes.firstChildOf(node) != NO_INODE)
+                    node = inodes.firstChildOf(node);
+                else
+                {
+                    while (node != pending.top && inodes.nextSiblingOf(node) == NO_INODE)
+                        node = inodes.parentOf(node);
+                    node = (node == pending.top) ? NO_INODE : inodes.nextSiblingOf(node);
+                }
+
+                if (--budget == 0 && node != NO_INODE)
+                {
+                    countCursor = node;
+                    return;
+                }
+            }
+            countedTrees++;
+        }
+    }
+
+    Inode copyNode(Inode source, string_view name)
+    {
+        if (inodes.isFolder(source))
+            return inodes.create(FOLDER_INODE, name);
+
+        Inode copy = inodes.create(FILE_INODE, name);
+        inodes.extents[copy] = inodes.extents[source];
+        inodes.inlineData[copy] = inodes.inlineData[source];
+        inodes.tails[copy] = inodes.tails[source];
+        inodes.size[copy] = inodes.size[source];
+        for (const Extent &run : inodes.extents[copy])
+            shares.add(run.start, run.length, 1);
+        if (inodes.tails[copy].length > 0)
+            tailStore.share(inodes.tails[copy]);
+        return copy;
+    }
+
+    Inode copyItem(Inode source, string_view name)
+    {
+        Inode top = copyNode(source, name);
+        try
+        {
+            Inode node = inodes.firstChildOf(source);
+            Inode target = top;
+            while (node != NO_INODE)
+            {
+                Inode copy = copyNode(node, inodes.name(node));
+                inodes.link(target, copy);
+
+                if (inodes.firstChildOf(node) != NO_INODE)
+                {
+                    target = copy;
+                    node = inodes.firstChildOf(node);
+                    continue;
+                }
+
+                while (node != source && inodes.nextSiblingOf(node) == NO_INODE)
+                {
+                    node = inodes.parentOf(node);
+                    target = inodes.parentOf(target);
+                }
+                node = (node == source) ? NO_INODE : inodes.nextSiblingOf(node);
+            }
+        }
+        catch (...)
+        {
+            deleteTree(top);
+            throw;
+        }
+        return top;
+    }
+
+    FileData resolveFile(const string &path)
+    {
+        FileData data;
+        if (!path.empty() && path[0] == '@')
         {
-            for (int sector : item->sectors)
-                freeSector(sector);
+            uint32_t snapshot;
+            Inode file = resolveSnapshotPath(path, snapshot);
+            if (file == NO_INODE || snapshotIsFolder(file, snapshot))
+                throw runtime_error("File not found: " + path);
+
+            const Version *version = versionAt(file, snapshot);
+            if (version)
+                data = {&version->extents, &version->inlined, version->tail, version->size};
+            else
+                data = {&inodes.extents[file], &inodes.inlineData[file], inodes.tails[file], inodes.size[file]};
+        }
+        else
+        {
+            Inode file = getItem(path);
+            if (file == NO_INODE || inodes.isFolder(file))
+                throw runtime_error("File not found: " + path);
+            data = {&inodes.extents[file], &inodes.inlineData[file], inodes.tails[file], inodes.size[file]};
         }
 
-        for (Item *child : item->children)
-            freeSectorsRecursive(child);
+        if (!data.extents->empty() || data.tail.length > 0)
+            data.inlined = nullptr;
+        return data;
     }
 
-    void deleteTree(Item *node)
+    void lsSnapshot(const string &path, const string &after, const string &prefix, size_t limit)
     {
-        if (!node)
+        uint32_t snapshot;
+        Inode target = resolveSnapshotPath(path, snapshot);
+        if (target == NO_INODE)
+            throw runtime_error("Path not found: " + path);
+
+        if (!snapshotIsFolder(target, snapshot))
+        {
+            const Version *version = versionAt(target, snapshot);
+            cout << "Name: " << path.substr(path.find_last_of('/') + 1) << endl;
+            cout << "Path: " << path << endl;
+            cout << "Size: " << (version ? version->size : inodes.size[target]) << " bytes" << endl;
             return;
+        }
+
+        listSnapshotChildren(target, snapshot, after, prefix, limit, [&](string_view name, Inode child)
+                             {
+                                 cout << name;
+                                 if (snapshotIsFolder(child, snapshot))
+                                     cout << "/";
+                                 cout << '\n';
+                             });
+        cout << flush;
+    }
+
+    template <typename Work>
+    static size_t nanosPer(size_t ops, Work work)
+    {
+        auto started = chrono::steady_clock::now();
+        work();
+        double nanos = chrono::duration<double, nano>(chrono::steady_clock::now() - started).count();
+        return size_t(nanos / max(ops, size_t(1)) + 0.5);
+    }
+
+    static void benchBitmap(size_t sectors)
+    {
+        if (sectors == 0 || sectors > size_t(INT_MAX))
+            throw runtime_error("Sector count must be between 1 and " + to_string(INT_MAX));
+
+        // Full disk with one free sector at a random offset, as seen by an allocation near the end of space.
+        mt19937 random(1);
+        vector<int> holes(1 << 16);
+        for (int &hole : holes)
+            hole = random() % sectors;
+
+        vector<bool> scanMap(sectors, true);
+        SectorBitmap bitmap;
+        bitmap.resize(sectors);
+        bitmap.assign(0, sectors, true);
+
+        size_t scanRounds = max(size_t(10), size_t(1000000000) / sectors);
+        size_t bitmapRounds = 1000000;
+        size_t found = 0;
+        size_t scanNanos = nanosPer(scanRounds, [&]()
+                                    {
+                                        for (size_t round = 0; round < scanRounds; round++)
+                                        {
+                                            int hole = holes[round % holes.size()];
+                                            scanMap[hole] = false;
+                                            size_t i = 0;
+                                            while (i < sectors && scanMap[i])
+                                                i++;
+                                            found += (int(i) == hole);
+                                            scanMap[hole] = true;
+                                        }
+                                    });
+        size_t bitmapNanos = nanosPer(bitmapRounds, [&]()
+                                      {
+                                          for (size_t round = 0; round < bitmapRounds; round++)
+                                          {
+                                              int hole = holes[round % holes.size()];
+                                              bitmap.markFree(hole);
+                                              found += (bitmap.findFirstFree() == hole);
+                                              bitmap.markUsed(hole);
+                                          }
+                                      });
+        if (found != scanRounds + bitmapRounds)
+            throw runtime_error("Bitmap benchmark found the wrong sector");
+
+        cout << "Sectors: " << sectors << endl;
+        cout << "Linear scan: " << scanNanos << " ns per allocation" << endl;
+        cout << "Word bitmap: " << bitmapNanos << " ns per allocation" << endl;
+    }
+
+    static vector<string> benchNames(size_t count)
+    {
+        mt19937 random(2);
+        vector<string> names;
+        names.reserve(count);
+        for (size_t i = 0; i < count; i++)
+            names.push_back("entry" + to_string(i) + "_" + to_string(random() % 1000));
+        shuffle(names.begin(), names.end(), random);
+        return names;
+    }
+
+    static void benchLookup(size_t entries)
+    {
+        if (entries == 0 || entries >= NO_INODE - 1)
+            throw runtime_error("Entry count out of range");
+
+        vector<string> names = benchNames(entries);
+        FileSystem scratch(1);
+        lock_guard<mutex> hold(scratch.stateLock);
+        Inode dir = scratch.inodes.create(FOLDER_INODE, "bench");
+        scratch.addChild(scratch.root, dir);
+        vector<Inode> children(entries);
+        for (size_t i = 0; i < entries; i++)
+        {
+            children[i] = scratch.inodes.create(FILE_INODE, names[i]);
+            scratch.addChild(dir, children[i]);
+        }
+
+        mt19937 random(3);
+        vector<Inode> probes(1 << 16);
+        for (Inode &probe : probes)
+            probe = random() % entries;
+
+        size_t scanRounds = max(size_t(10), size_t(200000000) / entries);
+        size_t indexRounds = 1000000;
+        size_t found = 0;
+        size_t scanNanos = nanosPer(scanRounds, [&]()
+                                    {
+                                        for (size_t round = 0; round < scanRounds; round++)
+                                        {
+                                            const string &key = names[probes[round % probes.size()]];
+                                            for (const string &name : names)
+                                            {
+                                                if (name == key)
+                                                {
+                                                    found++;
+                                                    break;
+                                                }
+                                            }
+                                        }
+                                    });
+        size_t indexNanos = nanosPer(indexRounds, [&]()
+                                     {
+                                         for (size_t round = 0; round < indexRounds; round++)
+                                         {
+                                             Inode probe = probes[round % probes.size()];
+                                             found += (scratch.findChild(dir, names[probe]) == children[probe]);
+                                         }
+                                     });
+        if (found != scanRounds + indexRounds)
+            throw runtime_error("Lookup benchmark missed an entry");
+
+        cout << "Entries: " << entries << endl;
+        cout << "Linear scan: " << scanNanos << " ns per lookup" << endl;
+        cout << "Directory lookup: " << indexNanos << " ns per lookup" << endl;
+    }
 
-        for (Item *child : node->children)
-            deleteTree(child);
+    static void benchDirectory(size_t entries)
+    {
+        if (entries == 0 || entries > NO_INODE / 4)
+            throw runtime_error("Entry count out of range");
+
+        size_t arrayInserts = min(entries, max(size_t(100), size_t(1000000000) / entries));
+        size_t treeInserts = min(entries, size_t(100000));
+        vector<string> names = benchNames(entries + max(arrayInserts, treeInserts));
+        auto nameOf = [&](Inode inode)
+        { return string_view(names[inode]); };
+
+        vector<Inode> ordered(entries);
+        for (Inode inode = 0; inode < entries; inode++)
+            ordered[inode] = inode;
+        sort(ordered.begin(), ordered.end(), [&](Inode a, Inode b)
+             { return names[a] < names[b]; });
+        SortedChildren array;
+        ChildTree tree;
+        for (Inode inode : ordered)
+            array.append(inode);
+        for (Inode inode = 0; inode < entries; inode++)
+            tree.insert(inode, names[inode], nameOf);
+
+        mt19937 random(4);
+        vector<Inode> probes(1 << 16);
+        for (Inode &probe : probes)
+            probe = random() % entries;
+        size_t lookups = 1000000;
+        size_t scans = max(size_t(1), size_t(10000000) / entries);
+        size_t checked = 0, expected = 0, nameBytes = 0;
+
+        size_t arrayInsert = nanosPer(arrayInserts, [&]()
+                                      {
+                                          for (size_t i = 0; i < arrayInserts; i++)
+                                              array.insert(entries + i, names[entries + i], nameOf);
+                                      });
+        size_t treeInsert = nanosPer(treeInserts, [&]()
+                                     {
+                                         for (size_t i = 0; i < treeInserts; i++)
+                                             tree.insert(entries + i, names[entries + i], nameOf);
+                                     });
+        size_t arrayLookup = nanosPer(lookups, [&]()
+                                      {
+                                          for (size_t round = 0; round < lookups; round++)
+                                          {
+                                              Inode probe = probes[round % probes.size()];
+                                              array.scan(names[probe], true, nameOf, [&](Inode entry)
+                                                         {
+                                                             checked += (entry == probe);
+                                                             return false;
+                                                         });
+                                          }
+                                      });
+        size_t treeLookup = nanosPer(lookups, [&]()
+                                     {
+                                         for (size_t round = 0; round < lookups; round++)
+                                         {
+                                             Inode probe = probes[round % probes.size()];
+                                             checked += (tree.find(names[probe], nameOf) == probe);
+                                         }
+                                     });
+        expected += 2 * lookups;
+
+        auto scanAll = [&](const auto &children)
+        {
+            size_t entriesScanned = scans * children.size();
+            size_t nanos = nanosPer(1, [&]()
+                            {
+                                for (size_t round = 0; round < scans; round++)
+                                {
+                                    children.scan("", true, nameOf, [&](Inode entry)
+                                                  {
+                                                      checked++;
+                                                      nameBytes += nameOf(entry).size();
+                                                      return true;
+                                                  });
+                                }
+                            });
+            return size_t(entriesScanned * 1e3 / max(nanos, size_t(1)));
+        };
+        size_t arrayScan = scanAll(array);
+        size_t treeScan = scanAll(tree);
+        expected += scans * (array.size() + tree.size());
+        if (checked != expected || nameBytes == 0)
+            throw runtime_error("Directory benchmark lost an entry");
+
+        cout << "Entries: " << entries << endl;
+        cout << "Sorted array: " << arrayInsert << " ns per insert, " << arrayLookup << " ns per lookup, "
+             << arrayScan << "M entries/s scanned" << endl;
+        cout << "B+tree: " << treeInsert << " ns per insert, " << treeLookup << " ns per lookup, "
+             << treeScan << "M entries/s scanned" << endl;
+    }
+
+    static void benchTree(size_t files)
+    {
+        const size_t perFolder = 1000;
+        if (files == 0 || files > NO_INODE / 2)
+            throw runtime_error("File count out of range");
+
+        FileSystem scratch(1);
+        lock_guard<mutex> hold(scratch.stateLock);
+        auto rate = [files](size_t nanos)
+        { return size_t(files * 1e9 / max(nanos, size_t(1))); };
 
-        freeSectorsRecursive(node);
-        delete node;
+        cout << "Files: " << files << " in folders of " << perFolder << endl;
+        for (const char *pass : {"fresh", "reused"})
+        {
+            Inode top = NO_INODE;
+            size_t createNanos = nanosPer(1, [&]()
+                                          {
+                                              top = scratch.inodes.create(FOLDER_INODE, "bench");
+                                              scratch.addChild(scratch.root, top);
+                                              Inode folder = NO_INODE;
+                                              for (size_t i = 0; i < files; i++)
+                                              {
+                                                  if (i % perFolder == 0)
+                                                  {
+                                                      folder = scratch.inodes.create(FOLDER_INODE, "d" + to_string(i / perFolder));
+                                                      scratch.addChild(top, folder);
+                                                  }
+                                                  scratch.addChild(folder, scratch.inodes.create(FILE_INODE, "f" + to_string(i % perFolder)));
+                                              }
+                                          });
+            size_t deleteNanos = nanosPer(1, [&]()
+                                          {
+                                              scratch.removeChild(scratch.root, top);
+                                              scratch.deleteTree(top);
+                                              scratch.reclaimAll();
+                                          });
+            cout << "Create (" << pass << " inodes): " << rate(createNanos) << " files/s" << endl;
+            cout << "Delete (" << pass << " inodes): " << rate(deleteNanos) << " files/s" << endl;
+        }
     }
 
-    Item *copyItem(Item *source, Item *newParent)
+    static void benchPath(size_t files)
     {
-        Item *newItem = new Item();
-        newItem->isFolder = source->isFolder;
-        newItem->name = source->name;
-        newItem->content = source->content;
-        newItem->parent = newParent;
-
-        if (!source->isFolder)
+        if (files <= DENTRY_CACHE_SIZE || files > NO_INODE / 2)
+            throw runtime_error("File count must exceed the dentry cache size (" + to_string(DENTRY_CACHE_SIZE) + ")");
+
+        FileSystem scratch(1);
+        lock_guard<mutex> hold(scratch.stateLock);
+        Inode top = scratch.inodes.create(FOLDER_INODE, "bench");
+        scratch.addChild(scratch.root, top);
+        vector<string> paths(files);
+        Inode outer = NO_INODE, inner = NO_INODE;
+        for (size_t i = 0; i < files; i++)
         {
-            newItem->sectors.clear();
-            saveToDisk(newItem);
+            if (i % 1000 == 0)
+            {
+                outer = scratch.inodes.create(FOLDER_INODE, "d" + to_string(i / 1000));
+                scratch.addChild(top, outer);
+            }
+            if (i % 100 == 0)
+            {
+                inner = scratch.inodes.create(FOLDER_INODE, "e" + to_string(i / 100 % 10));
+                scratch.addChild(outer, inner);
+            }
+            scratch.addChild(inner, scratch.inodes.create(FILE_INODE, "f" + to_string(i % 100)));
+            paths[i] = "/bench/d" + to_string(i / 1000) + "/e" + to_string(i / 100 % 10) + "/f" + to_string(i % 100);
         }
 
-        for (Item *child : source->children)
+        // Hits cycle through half a cache worth of paths; misses cycle through every
+        // path, which always evicts before a path comes round again.
+        const size_t rounds = 1000000;
+        cout << "Files: " << files << ", dentry cache: " << DENTRY_CACHE_SIZE << " entries" << endl;
+        for (size_t distinct : {DENTRY_CACHE_SIZE / 2, files})
         {
-            Item *newChild = copyItem(child, newItem);
-            newItem->children.push_back(newChild);
+            size_t found = 0;
+            for (size_t warm = 0; warm < 2 * files; warm++)
+                found += (scratch.getItem(paths[warm % distinct]) != NO_INODE);
+
+            size_t allocations = heapAllocations;
+            size_t nanos = nanosPer(rounds, [&]()
+                                    {
+                                        for (size_t round = 0; round < rounds; round++)
+                                            found += (scratch.getItem(paths[round % distinct]) != NO_INODE);
+                                    });
+            allocations = heapAllocations - allocations;
+            if (found != 2 * files + rounds)
+                throw runtime_error("Path benchmark missed a file");
+
+            cout << (distinct == files ? "Miss: " : "Hit: ") << nanos << " ns, "
+                 << double(allocations) / rounds << " allocations per lookup" << endl;
         }
-
-        return newItem;
     }
 
 public:
-    FileSystem(int capacity) : totalSectors(capacity)
+    FileSystem(int capacity) : disk(size_t(capacity) * SECTOR_SIZE), totalSectors(capacity)
     {
-        sectorMap.resize(totalSectors, false);
-        disk.resize(totalSectors, "");
+        sectorMap.resize(totalSectors);
+        sectorMap.assign(0, totalSectors, false);
+        freeExtents.reset(0, totalSectors);
 
-        root = new Item();
-        root->isFolder = true;
-        root->name = "/";
-        root->parent = nullptr;
+        root = inodes.create(FOLDER_INODE, "/");
 
         currentDir = root;
+        reclaimer = thread(&FileSystem::reclaimLoop, this);
     }
 
     ~FileSystem()
     {
-        deleteTree(root);
+        {
+            lock_guard<mutex> guard(stateLock);
+            stopping = true;
+        }
+        reclaimWake.notify_one();
+        reclaimer.join();
     }
 
     void pwd()
     {
+        lock_guard<mutex> guard(stateLock);
         cout << getFullPath(currentDir) << endl;
     }
 
     void cd(const string &path)
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
-            Item *target = getItem(path);
+            Inode target = getItem(path);
 
-            if (!target)
+            if (target == NO_INODE)
                 throw runtime_error("Directory not found: " + path);
-            if (!target->isFolder)
+            if (!inodes.isFolder(target))
                 throw runtime_error("Not a directory: " + path);
 
             currentDir = target;
@@ -277,39 +3444,41 @@ public:
 
     }
 
-    void ls(const string &path = "")
+    void ls(const string &path = "", const string &after = "", const string &prefix = "", size_t limit = SIZE_MAX)
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
-            Item *target = currentDir;
+            if (!path.empty() && path[0] == '@')
+            {
+                lsSnapshot(path, after, prefix, limit);
+                return;
+            }
+
+            Inode target = currentDir;
             if (!path.empty())
             {
                 target = getItem(path);
-                if (!target)
+                if (target == NO_INODE)
                     throw runtime_error("Path not found: " + path);
 
-                if (!target->isFolder)
+                if (!inodes.isFolder(target))
                 {
-                    cout << "Name: " << target->name << endl;
+                    cout << "Name: " << inodes.name(target) << endl;
                     cout << "Path: " << getFullPath(target) << endl;
-                    cout << "Size: " << target->content.length() << " bytes" << endl;
+                    cout << "Size: " << inodes.size[target] << " bytes" << endl;
                     return;
                 }
             }
 
-            vector<string> items;
-            for (Item *child : target->children)
-            {
-                string name = child->name;
-                if (child->isFolder)
-                    name += "/";
-                items.push_back(name);
-            }
-
-            sort(items.begin(), items.end());
-
-            for (const string &item : items)
-                cout << item << endl;
+            inodes.listChildren(target, after, prefix, limit, [this](Inode child)
+                                {
+                                    cout << inodes.name(child);
+                                    if (inodes.isFolder(child))
+                                        cout << "/";
+                                    cout << '\n';
+                                });
+            cout << flush;
         }
         catch (const exception &e)
         {
@@ -319,55 +3488,43 @@ public:
 
     void mkdir(const string &path)
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
             if (path.empty())
                 throw runtime_error("mkdir: missing path");
 
-            vector<string> parts = splitPath(path);
-            if (parts.empty())
+            PathTokenizer parts(path);
+            string_view part;
+            if (!parts.next(part))
                 throw runtime_error("Invalid path");
 
-            Item *current = (path[0] == '/') ? root : currentDir;
+            Inode current = (path[0] == '/') ? root : currentDir;
 
-            for (const string &part : parts)
+            do
             {
                 if (part.empty() || part == "." || part == "..")
-                    throw runtime_error("Invalid directory name in path: " + part);
+                    throw runtime_error("Invalid directory name in path: " + string(part));
 
                 if (!isValidName(part))
-                    throw runtime_error("Invalid directory name: " + part);
+                    throw runtime_error("Invalid directory name: " + string(part));
 
-                bool found = false;
-                Item *next = nullptr;
-                for (Item *child : current->children)
-                {
-                    if (child->name == part)
-                    {
-                        if (!child->isFolder)
-                            throw runtime_error("Cannot create directory: '" + part + "' — a file with this name exists");
-                        next = child;
-                        found = true;
-                        break;
-                    }
-                }
+                Inode next = findChild(current, part);
+                if (next != NO_INODE && !inodes.isFolder(next))
+                    throw runtime_error("Cannot create directory: '" + string(part) + "' — a file with this name exists");
 
-                if (found)
+                if (next != NO_INODE)
                     current = next;
                 else
                 {
-                    Item *newDir = new Item();
-                    newDir->isFolder = true;
-                    newDir->name = part;
-                    newDir->parent = current;
-                    newDir->children = {};
+                    Inode newDir = inodes.create(FOLDER_INODE, part);
 
-                    current->children.push_back(newDir);
+                    addChild(current, newDir);
                     current = newDir;
 
                     cout << "Directory created:" << getFullPath(current) << endl;
                 }
-            }
+            } while (parts.next(part));
         }
         catch (const exception &e)
         {
@@ -377,49 +3534,30 @@ public:
 
     void touch(const string &filename)
     {
+        lock_guard<mutex> guard(stateLock);
         if (!isValidName(filename))
             throw runtime_error("Invalid file name: " + filename);
-        for (Item *child : currentDir->children)
-        {
-            if (child->name == filename)
-                throw runtime_error("File already exists: " + filename);
-        }
+        if (findChild(currentDir, filename) != NO_INODE)
+            throw runtime_error("File already exists: " + filename);
 
-        Item *newFile = new Item();
-        newFile->isFolder = false;
-        newFile->name = filename;
-        newFile->content = "";
-        newFile->parent = currentDir;
+        Inode newFile = inodes.create(FILE_INODE, filename);
 
-        currentDir->children.push_back(newFile);
-        saveToDisk(newFile);
+        addChild(currentDir, newFile);
         cout << "File created: " << filename << endl;
     }
 
     void rm(const string &name, bool recursive = false)
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
-            Item *target = nullptr;
-            for (Item *child : currentDir->children)
-            {
-                if (name == child->name)
-                {
-                    target = child;
-                    break;
-                }
-            }
-
-            if (!target)
+            Inode target = findChild(currentDir, name);
+            if (target == NO_INODE)
                 throw runtime_error("File or directory not found: " + name);
-            if (target->isFolder && !target->children.empty() && !recursive)
+            if (inodes.isFolder(target) && inodes.firstChildOf(target) != NO_INODE && !recursive)
                 throw runtime_error("Directory is not empty. Use -r flag to remove recursively");
 
-            auto &folders = currentDir->children;
-            auto it = find(folders.begin(), folders.end(), target);
-            if (it != folders.end())
-                folders.erase(it);
-
+            removeChild(currentDir, target);
             deleteTree(target);
 
             cout << "Removed: " << name;
@@ -435,58 +3573,39 @@ public:
 
     void cp(const string &source, const string &dest)
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
-            Item *srcItem = getItem(source);
-            if (!srcItem)
+            Inode srcItem = getItem(source);
+            if (srcItem == NO_INODE)
                 throw runtime_error("Source not found: " + source);
 
-            Item *destItem = getItem(dest);
+            Inode destItem = getItem(dest);
 
-            if (destItem && destItem->isFolder)
+            if (destItem != NO_INODE && inodes.isFolder(destItem))
             {
-                string destName = srcItem->name;
-                for (Item *child : destItem->children)
-                {
-                    if (child->name == destName)
-                        throw runtime_error("Destination already exists: " + destName);
-                }
+                string destName(inodes.name(srcItem));
+                if (findChild(destItem, destName) != NO_INODE)
+                    throw runtime_error("Destination already exists: " + destName);
 
-                Item *newItem = copyItem(srcItem, destItem);
-                destItem->children.push_back(newItem);
+                addChild(destItem, copyItem(srcItem, destName));
 
                 cout << "Copied: " << source << " -> " << dest << "/" << destName << endl;
             }
 
             else
             {
-                int lastSlash = dest.find_last_of('/');
-                string destDirPath, destName;
-
-                if (lastSlash == string::npos)
-                {
-                    destDirPath = ".";
-                    destName = dest;
-                }
-                else
-                {
-                    destDirPath = dest.substr(0, lastSlash);
-                    destName = dest.substr(lastSlash + 1);
-                }
+                string_view destDirPath, destName;
+                splitDestination(dest, destDirPath, destName);
 
-                Item *destDir = getItem(destDirPath);
-                if (!destDir || !destDir->isFolder)
+                Inode destDir = getItem(destDirPath);
+                if (destDir == NO_INODE || !inodes.isFolder(destDir))
                     throw runtime_error("Destination directory not found");
 
-                for (Item *child : destDir->children)
-                {
-                    if (child->name == destName)
-                        throw runtime_error("Destination already exists: " + destName);
-                }
+                if (findChild(destDir, destName) != NO_INODE)
+                    throw runtime_error("Destination already exists: " + string(destName));
 
-                Item *newItem = copyItem(srcItem, destDir);
-                newItem->name = destName;
-                destDir->children.push_back(newItem);
+                addChild(destDir, copyItem(srcItem, destName));
 
                 cout << "Copied: " << source << " -> " << dest << endl;
             }
@@ -499,99 +3618,68 @@ public:
 
     void mv(const string &source, const string &dest)
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
-            Item *srcItem = getItem(source);
-            if (!srcItem)
+            Inode srcItem = getItem(source);
+            if (srcItem == NO_INODE)
                 throw runtime_error("Source not found: " + source);
 
-            if (srcItem->isFolder)
+            if (inodes.isFolder(srcItem))
             {
-                Item *checkItem = getItem(dest);
-                while (checkItem)
+                Inode checkItem = getItem(dest);
+                while (checkItem != NO_INODE)
                 {
                     if (checkItem == srcItem)
                     {
                         throw runtime_error("Cannot move a folder into itself");
                     }
-                    checkItem = checkItem->parent;
+                    checkItem = inodes.parentOf(checkItem);
                 }
             }
 
-            Item *destItem = getItem(dest);
+            Inode destItem = getItem(dest);
 
-            if (destItem && destItem->isFolder)
+            if (destItem != NO_INODE && inodes.isFolder(destItem))
             {
-                for (Item *child : destItem->children)
-                {
-                    if (child->name == srcItem->name)
-                        throw runtime_error("Destination already exists: " + srcItem->name);
-                }
+                if (findChild(destItem, inodes.name(srcItem)) != NO_INODE)
+                    throw runtime_error("Destination already exists: " + string(inodes.name(srcItem)));
 
-                if (srcItem->parent != destItem)
+                if (inodes.parentOf(srcItem) != destItem)
                 {
-                    if (srcItem->parent)
-                    {
-                        auto &folder = srcItem->parent->children;
-                        auto it = find(folder.begin(), folder.end(), srcItem);
-                        if (it != folder.end())
-                            folder.erase(it);
-                    }
+                    if (inodes.parentOf(srcItem) != NO_INODE)
+                        removeChild(inodes.parentOf(srcItem), srcItem);
 
-                    srcItem->parent = destItem;
-                    destItem->children.push_back(srcItem);
+                    addChild(destItem, srcItem);
                 }
 
-                cout << "Moved: " << source << " -> " << dest << "/" << srcItem->name << endl;
+                cout << "Moved: " << source << " -> " << dest << "/" << inodes.name(srcItem) << endl;
             }
 
             else
             {
+                string_view destDirPath, destName;
+                splitDestination(dest, destDirPath, destName);
 
-                int lastSlash = dest.find_last_of('/');
-                string destDirPath, destName;
-
-                if (lastSlash == string::npos)
-                {
-                    destDirPath = ".";
-                    destName = dest;
-                }
-                else
-                {
-                    destDirPath = dest.substr(0, lastSlash);
-                    destName = dest.substr(lastSlash + 1);
-                }
-
-                Item *destDir = getItem(destDirPath);
-                if (!destDir || !destDir->isFolder)
+                Inode destDir = getItem(destDirPath);
+                if (destDir == NO_INODE || !inodes.isFolder(destDir))
                     throw runtime_error("Destination directory not found");
 
-                for (Item *child : destDir->children)
-                {
-                    if (child->name == destName && child != srcItem)
-                        throw runtime_error("Destination already exists: " + destName);
-                }
+                Inode existing = findChild(destDir, destName);
+                if (existing != NO_INODE && existing != srcItem)
+                    throw runtime_error("Destination already exists: " + string(destName));
 
-                bool sameParent = (srcItem->parent == destDir);
+                bool sameParent = (inodes.parentOf(srcItem) == destDir);
 
                 if (!sameParent)
                 {
-                    if (srcItem->parent)
-                    {
-                        auto &siblings = srcItem->parent->children;
-                        auto it = find(siblings.begin(), siblings.end(), srcItem);
-                        if (it != siblings.end())
-                            siblings.erase(it);
-                    }
+                    if (inodes.parentOf(srcItem) != NO_INODE)
+                        removeChild(inodes.parentOf(srcItem), srcItem);
                 }
 
-                srcItem->name = destName;
-
+                renameItem(srcItem, destName);
                 if (!sameParent)
-                {
-                    srcItem->parent = destDir;
-                    destDir->children.push_back(srcItem);
-                }
+                    addChild(destDir, srcItem);
 
                 cout << "Moved: " << source << " -> " << dest << endl;
             }
@@ -602,15 +3690,79 @@ public:
         }
     }
 
-    void get(const string &filename)
+    void read(const string &filename, size_t offset, size_t length)
+    {
+        lock_guard<mutex> guard(stateLock);
+        try
+        {
+            FileData file = resolveFile(filename);
+            if (offset > file.size)
+                throw runtime_error("Offset " + to_string(offset) + " is beyond end of file (" +
+                                    to_string(file.size) + " bytes)");
+
+            length = min(length, file.size - offset);
+            if (file.inlined)
+                cout.write(file.inlined->data() + offset, length);
+            else
+                forEachRange(*file.extents, offset, length, [](const char *data, size_t len)
+                             { cout.write(data, len); });
+
+            size_t body = file.size - file.tail.length;
+            if (offset + length > body)
+            {
+                size_t from = max(offset, body) - body;
+                cout.write(disk.sector(file.tail.sector) + file.tail.offset + from, offset + length - body - from);
+            }
+            cout << endl;
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error: " << e.what() << endl;
+        }
+    }
+
+    void write(const string &filename, size_t offset, const string &data)
+    {
+        lock_guard<mutex> guard(stateLock);
+        try
+        {
+            Inode file = getItem(filename);
+            if (file == NO_INODE || inodes.isFolder(file))
+                throw runtime_error("File not found: " + filename);
+
+            writeAt(file, offset, data);
+            cout << "Wrote " << data.length() << " bytes at offset " << offset << endl;
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error: " << e.what() << endl;
+        }
+    }
+
+    void append(const string &filename, const string &data)
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
-            Item *file = getItem(filename);
-            if (!file || file->isFolder)
+            Inode file = getItem(filename);
+            if (file == NO_INODE || inodes.isFolder(file))
                 throw runtime_error("File not found: " + filename);
 
-            cout << file->content << endl;
+            writeAt(file, inodes.size[file], data);
+            cout << "Appended " << data.length() << " bytes, size is now " << inodes.size[file] << " bytes" << endl;
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error: " << e.what() << endl;
+        }
+    }
+
+    void get(const string &filename)
+    {
+        lock_guard<mutex> guard(stateLock);
+        try
+        {
+            FileData file = resolveFile(filename);
 
             string fileName;
             int lastSlash = filename.find_last_of('/');
@@ -619,12 +3771,13 @@ public:
             else
                 fileName = filename;
 
-            ofstream outFile(fileName);
-            if (!outFile.is_open())
+            HostFile outFile(fileName, O_WRONLY | O_CREAT | O_TRUNC);
+            if (!outFile.isOpen())
                 throw runtime_error("Cannot create file: " + fileName);
 
-            outFile << file->content;
-            outFile.close();
+            exportToHost(outFile.descriptor(), file);
+            cout << "File exported to real system: " << filename << " -> " << fileName
+                 << " (" << file.size << " bytes)" << endl;
         }
         catch (const exception &e)
         {
@@ -634,42 +3787,49 @@ public:
 
     void put(const string &realFile, const string &fsPath)
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
-            ifstream file(realFile);
-            if (!file.is_open())
+            auto started = chrono::steady_clock::now();
+
+            HostFile file(realFile, O_RDONLY);
+            struct stat status;
+            if (!file.isOpen() || fstat(file.descriptor(), &status) != 0)
                 throw runtime_error("Cannot open real file: " + realFile);
 
-            string content, line;
-            while (getline(file, line))
-                content += line + "\n";
-            file.close();
+            Inode destDir = getItem(fsPath);
+            if (destDir == NO_INODE || !inodes.isFolder(destDir))
+                throw runtime_error("Destination directory not found");
 
-            if (!content.empty() && content.back() == '\n')
-                content.pop_back();
+            if (findChild(destDir, realFile) != NO_INODE)
+                throw runtime_error("File already exists: " + realFile);
 
-            Item *destDir = getItem(fsPath);
-            if (!destDir || !destDir->isFolder)
-                throw runtime_error("Destination directory not found");
+            Inode newFile = inodes.create(FILE_INODE, realFile);
 
-            for (Item *child : destDir->children)
+            size_t loaded;
+            try
+            {
+                // Pipes and devices report no usable size, so they are read in chunks until EOF.
+                if (S_ISREG(status.st_mode))
+                    loaded = loadFromHost(file.descriptor(), newFile, status.st_size);
+                else
+                    loaded = streamFromHost(file.descriptor(), newFile);
+            }
+            catch (...)
             {
-                if (!child->isFolder && realFile == child->name)
-                    throw runtime_error("File already exists: " + realFile);
+                dropTail(newFile);
+                truncateFile(newFile, 0);
+                inodes.destroy(newFile);
+                throw;
             }
+            addChild(destDir, newFile);
 
-            Item *newFile = new Item();
-            newFile->isFolder = false;
-            newFile->name = realFile;
-            newFile->content = content;
-            newFile->parent = destDir;
-
-            destDir->children.push_back(newFile);
-            saveToDisk(newFile);
-
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
             cout << "File copied from real system: " << realFile
-                 << " -> " << fsPath << endl;
-            cout << newFile->content << endl;
+                 << " -> " << fsPath << " (" << loaded << " bytes";
+            if (seconds > 0)
+                cout << ", " << (loaded / 1048576.0) / seconds << " MB/s";
+            cout << ")" << endl;
         }
         catch (const exception &e)
         {
@@ -679,24 +3839,59 @@ public:
 
     void info(const string &filename)
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
-            Item *file = getItem(filename);
-            if (!file)
+            Inode file = getItem(filename);
+            if (file == NO_INODE)
                 throw runtime_error("File not found: " + filename);
 
-            cout << "Name: " << file->name << endl;
+            cout << "Name: " << inodes.name(file) << endl;
             cout << "Path: " << getFullPath(file) << endl;
-            if (!file->isFolder)
+            if (!inodes.isFolder(file))
             {
-                cout << "Size: " << file->content.length() << " bytes" << endl;
-                if (!file->sectors.empty())
+                cout << "Size: " << inodes.size[file] << " bytes" << endl;
+                const Tail &tail = inodes.tails[file];
+                if (inodes.extents[file].empty() && tail.length == 0 && inodes.size[file] > 0)
+                    cout << "Storage: inline (no sectors)" << endl;
+                if (!inodes.extents[file].empty())
                 {
-                    cout << "Sectors: ";
-                    for (int sector : file->sectors)
-                        cout << sector << " ";
+                    int count = 0;
+                    cout << "Extents: ";
+                    for (const Extent &run : inodes.extents[file])
+                    {
+                        cout << run.start;
+                        if (run.length > 1)
+                            cout << "-" << (run.start + run.length - 1);
+                        cout << " ";
+                        count += run.length;
+                    }
                     cout << endl;
+                    cout << "Sectors: " << count << endl;
+
+                    int sharedCount = 0;
+                    for (const Extent &run : inodes.extents[file])
+                    {
+                        shares.forEach(run.start, run.length, [&](int, int length, uint32_t extra)
+                                       { sharedCount += (extra > 0) ? length : 0; });
+                    }
+                    if (sharedCount > 0)
+                        cout << "Shared sectors: " << sharedCount << endl;
+
+                    int compressedBlocks = count_if(inodes.extents[file].begin(), inodes.extents[file].end(),
+                                                    [](const Extent &run)
+                                                    { return run.logical != 0; });
+                    if (compressedBlocks > 0)
+                    {
+                        int blocks = (sectorsFor(inodes.size[file]) + COMPRESS_BLOCK_SECTORS - 1) / COMPRESS_BLOCK_SECTORS;
+                        double ratio = inodes.size[file] / (double(count) * SECTOR_SIZE + tail.length);
+                        cout << "Compression ratio: " << int(ratio * 100 + 0.5) / 100.0 << ":1 ("
+                             << compressedBlocks << " of " << blocks << " blocks compressed)" << endl;
+                    }
                 }
+                if (tail.length > 0)
+                    cout << "Packed tail: " << int(tail.length) << " bytes in sector " << tail.sector
+                         << " at offset " << int(tail.offset) << endl;
             }
             else
             {
@@ -711,55 +3906,334 @@ public:
 
     void defrag()
     {
+        lock_guard<mutex> guard(stateLock);
         try
         {
             cout << "Starting disk defragmentation..." << endl;
+            reclaimAll();
 
-            vector<Item *> allFiles;
-            collectAllFiles(root, allFiles);
+            vector<Inode> allFiles;
+            collectAllFiles(allFiles);
 
             cout << "Found " << allFiles.size() << " files" << endl;
 
-            for (int i = 0; i < sectorMap.size(); i++)
-                sectorMap[i] = false;
+            if (compression)
+            {
+                for (Inode file : allFiles)
+                    compressRange(file, 0, sectorsFor(inodes.size[file]));
+            }
+            if (tailPacking)
+            {
+                for (Inode file : allFiles)
+                    packTail(file);
+            }
 
-            int nextSector = 0;
-            for (Item *file : allFiles)
+            vector<Tail *> tailRefs;
+            for (Inode file : allFiles)
             {
-                if (file->isFolder)
-                    continue;
+                if (inodes.tails[file].length > 0)
+                    tailRefs.push_back(&inodes.tails[file]);
+            }
+            for (auto &entry : history)
+            {
+                for (Version &version : entry.second)
+                {
+                    if (version.tail.length > 0)
+                        tailRefs.push_back(&version.tail);
+                }
+            }
+            sort(tailRefs.begin(), tailRefs.end(), [](const Tail *a, const Tail *b)
+                 { return make_pair(a->sector, a->offset) < make_pair(b->sector, b->offset); });
+
+            vector<string> tailBytes;
+            vector<int> oldPack;
+            vector<size_t> fragmentOf;
+            for (size_t i = 0; i < tailRefs.size(); i++)
+            {
+                const Tail &tail = *tailRefs[i];
+                if (i == 0 || tail.sector != tailRefs[i - 1]->sector || tail.offset != tailRefs[i - 1]->offset)
+                {
+                    tailBytes.emplace_back(disk.sector(tail.sector) + tail.offset, tail.length);
+                    oldPack.push_back(tail.sector);
+                }
+                fragmentOf.push_back(tailBytes.size() - 1);
+            }
+            // Pack contents are saved above, so the moves below may overwrite old packs like free sectors.
+            for (int sector : oldPack)
+                sectorMap.assign(sector, 1, false);
 
-                file->sectors.clear();
+            vector<int> source;
+            vector<int> placed(totalSectors, -1);
+            auto relocate = [&](vector<Extent> &extents)
+            {
+                vector<Extent> relocated;
+                for (const Extent &run : extents)
+                {
+                    for (int sector = run.start; sector < run.start + run.length; sector++)
+                    {
+                        if (placed[sector] < 0)
+                        {
+                            placed[sector] = source.size();
+                            source.push_back(sector);
+                        }
+                        if (!run.logical)
+                            appendRun(relocated, {placed[sector], 1});
+                    }
+                    if (run.logical)
+                        relocated.push_back({placed[run.start], run.length, run.logical});
+                }
+                extents.swap(relocated);
+            };
 
-                string data = file->content;
-                int pos = 0;
-                while (pos < data.length())
+            for (Inode file : allFiles)
+                relocate(inodes.extents[file]);
+            for (auto &entry : history)
+            {
+                for (Version &version : entry.second)
+                    relocate(version.extents);
+            }
+            int nextSector = source.size();
+
+            ShareCounts relocatedShares;
+            shares.forEach(0, totalSectors, [&](int start, int count, uint32_t extra)
+                           {
+                               if (extra == 0)
+                                   return;
+                               for (int sector = start; sector < start + count; sector++)
+                                   relocatedShares.add(placed[sector], 1, extra);
+                           });
+            swap(shares, relocatedShares);
+
+            vector<char> moved(nextSector, false);
+            char buffer[SECTOR_SIZE];
+            for (int pass = 0; pass < 2; pass++)
+            {
+                for (int target = 0; target < nextSector; target++)
                 {
-                    if (nextSector >= totalSectors)
-                        throw runtime_error("Disk is full");
+                    if (moved[target] || source[target] == target)
+                        continue;
+                    if (pass == 0 && sectorMap[target])
+                        continue;
+
+                    bool cycle = (pass == 1);
+                    if (cycle)
+                        memcpy(buffer, disk.sector(target), SECTOR_SIZE);
 
-                    sectorMap[nextSector] = true;
-                    file->sectors.push_back(nextSector);
+                    int current = target;
+                    while (true)
+                    {
+                        moved[current] = true;
+                        int from = source[current];
+                        if (cycle && from == target)
+                        {
+                            memcpy(disk.sector(current), buffer, SECTOR_SIZE);
+                            break;
+                        }
+                        memcpy(disk.sector(current), disk.sector(from), SECTOR_SIZE);
+                        if (from >= nextSector || moved[from])
+                            break;
+                        current = from;
+                    }
+                }
+            }
 
-                    while (nextSector >= disk.size())
-                        disk.push_back("");
+            vector<size_t> order(tailBytes.size());
+            for (size_t index = 0; index < order.size(); index++)
+                order[index] = index;
+            stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+                        { return tailBytes[a].size() > tailBytes[b].size(); });
+
+            TailStore layout;
+            vector<Tail> movedTails(tailBytes.size());
+            int packs = 0;
+            for (size_t index : order)
+            {
+                int length = tailBytes[index].size();
+                if (!layout.place(length, movedTails[index]))
+                {
+                    movedTails[index] = {nextSector + packs++, 0, uint8_t(length)};
+                    layout.claim(movedTails[index]);
+                }
+            }
 
-                    int len = min(SECTOR_SIZE, (int)data.length() - pos);
-                    disk[nextSector] = data.substr(pos, len);
-                    pos += len;
-                    nextSector++;
+            if (nextSector + packs > totalSectors)
+            {
+                // Largest-first packing lost to the old layout; keep each old pack's fragments together.
+                layout.clear();
+                packs = 0;
+                int used = 0;
+                for (size_t index = 0; index < tailBytes.size(); index++)
+                {
+                    if (index == 0 || oldPack[index] != oldPack[index - 1])
+                    {
+                        packs++;
+                        used = 0;
+                    }
+                    movedTails[index] = {nextSector + packs - 1, uint8_t(used), uint8_t(tailBytes[index].size())};
+                    layout.claim(movedTails[index]);
+                    used += tailBytes[index].size();
                 }
             }
 
+            swap(tailStore, layout);
+            for (size_t index = 0; index < tailBytes.size(); index++)
+            {
+                const Tail &tail = movedTails[index];
+                memcpy(disk.sector(tail.sector) + tail.offset, tailBytes[index].data(), tail.length);
+            }
+            for (size_t i = 0; i < tailRefs.size(); i++)
+            {
+                *tailRefs[i] = movedTails[fragmentOf[i]];
+                if (i > 0 && fragmentOf[i] == fragmentOf[i - 1])
+                    tailStore.share(*tailRefs[i]);
+            }
+
+            blockCache.clear();
+            int usedEnd = nextSector + packs;
+            sectorMap.assign(0, totalSectors, false);
+            sectorMap.assign(0, usedEnd, true);
+            freeExtents.reset(usedEnd, totalSectors - usedEnd);
+
             cout << "Defragmentation completed successfully!" << endl;
-            cout << "Used sectors: 0 to " << (nextSector - 1) << endl;
-            cout << "Free sectors: " << (totalSectors - nextSector) << endl;
+            cout << "Used sectors: 0 to " << (usedEnd - 1) << endl;
+            cout << "Free sectors: " << (totalSectors - usedEnd) << endl;
+            if (!tailBytes.empty())
+                cout << "Repacked " << tailBytes.size() << " tails into " << packs << " sectors" << endl;
         }
         catch (const exception &e)
         {
             cerr << "Error during defragmentation: " << e.what() << endl;
         }
     }
+
+    void df()
+    {
+        lock_guard<mutex> guard(stateLock);
+        int freeSectors = freeExtents.available();
+        cout << "Total sectors: " << totalSectors << endl;
+        cout << "Used sectors: " << (totalSectors - freeSectors - pendingSectors) << endl;
+        cout << "Free sectors: " << freeSectors << endl;
+        cout << "Pending reclaim: " << pendingSectors << " sectors in " << pendingItems << " items";
+        if (countedTrees < pendingTrees.size())
+            cout << " (still counting)";
+        cout << endl;
+    }
+
+    void showInlineLimit()
+    {
+        lock_guard<mutex> guard(stateLock);
+        cout << "Inline data limit: " << inlineLimit << " bytes" << endl;
+    }
+
+    void showTailPacking()
+    {
+        lock_guard<mutex> guard(stateLock);
+        cout << "Tail packing: " << (tailPacking ? "on" : "off") << endl;
+    }
+
+    void setTailPacking(bool enabled)
+    {
+        lock_guard<mutex> guard(stateLock);
+        tailPacking = enabled;
+        cout << "Tail packing: " << (tailPacking ? "on" : "off") << endl;
+    }
+
+    void showCompression()
+    {
+        lock_guard<mutex> guard(stateLock);
+        cout << "Compression: " << (compression ? "on" : "off") << endl;
+    }
+
+    void setCompression(bool enabled)
+    {
+        lock_guard<mutex> guard(stateLock);
+        compression = enabled;
+        cout << "Compression: " << (compression ? "on" : "off") << endl;
+    }
+
+    void setInlineLimit(size_t bytes)
+    {
+        lock_guard<mutex> guard(stateLock);
+        if (bytes > MAX_INLINE_DATA)
+        {
+            cerr << "Error: Inline data limit cannot exceed " << MAX_INLINE_DATA << " bytes" << endl;
+            return;
+        }
+        inlineLimit = bytes;
+        cout << "Inline data limit: " << inlineLimit << " bytes" << endl;
+    }
+
+    void createSnapshot(const string &name)
+    {
+        lock_guard<mutex> guard(stateLock);
+        try
+        {
+            uint32_t existing;
+            if (!isValidName(name))
+                throw runtime_error("Invalid snapshot name: " + name);
+            if (findSnapshot(name, existing))
+                throw runtime_error("Snapshot already exists: " + name);
+
+            snapshots[inodes.now++] = name;
+            cout << "Snapshot created: " << name << endl;
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error: " << e.what() << endl;
+        }
+    }
+
+    void listSnapshots()
+    {
+        lock_guard<mutex> guard(stateLock);
+        if (snapshots.empty())
+            cout << "No snapshots" << endl;
+        for (const auto &snapshot : snapshots)
+            cout << snapshot.second << endl;
+    }
+
+    void deleteSnapshot(const string &name)
+    {
+        lock_guard<mutex> guard(stateLock);
+        try
+        {
+            uint32_t id;
+            if (!findSnapshot(name, id))
+                throw runtime_error("Snapshot not found: " + name);
+
+            snapshots.erase(id);
+            dropUnusedVersions();
+            cout << "Snapshot deleted: " << name << endl;
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error: " << e.what() << endl;
+        }
+    }
+
+    // Benchmarks run on scratch structures and leave the mounted tree untouched.
+    void bench(const string &what, size_t count)
+    {
+        try
+        {
+            if (what == "bitmap")
+                benchBitmap(count);
+            else if (what == "lookup")
+                benchLookup(count);
+            else if (what == "tree")
+                benchTree(count);
+            else if (what == "directory")
+                benchDirectory(count);
+            else if (what == "path")
+                benchPath(count);
+            else
+                throw runtime_error("Unknown benchmark: " + what);
+        }
+        catch (const exception &e)
+        {
+            cerr << "Error: " << e.what() << endl;
+        }
+    }
 };
 
 void printHelp()
@@ -768,22 +4242,65 @@ void printHelp()
     cout << "pwd                     - Print working directory" << endl;
     cout << "cd <path>               - Change directory" << endl;
     cout << "ls [path]               - List directory contents" << endl;
+    cout << "ls [path] --limit <n> --after <name> - List one page of entries" << endl;
+    cout << "ls [path] --prefix <text> - List entries starting with text" << endl;
     cout << "mkdir <name>            - Create directory" << endl;
     cout << "touch <name>            - Create file" << endl;
     cout << "rm <name>               - Remove file" << endl;
     cout << "rm -r <name>            - Remove directory recursively" << endl;
     cout << "cp <source> <dest>      - Copy file or directory" << endl;
     cout << "mv <source> <dest>      - Move/rename file or directory" << endl;
-    cout << "get <file>              - Display file content" << endl;
+    cout << "get <file>              - Copy virtual file to real FS" << endl;
     cout << "put <real> <virtual>    - Copy real file to virtual FS" << endl;
+    cout << "read <file> <off> <len> - Display part of a file" << endl;
+    cout << "write <file> <off> <text> - Overwrite file bytes at offset" << endl;
+    cout << "append <file> <text>    - Append text to a file" << endl;
     cout << "info <file>             - Display file information" << endl;
     cout << "defrag                  - Defragment disk" << endl;
+    cout << "df                      - Show free space and pending reclaim" << endl;
+    cout << "inline [bytes]          - Show or set the inline data limit" << endl;
+    cout << "tailpack [on|off]       - Show or set packing of file tails" << endl;
+    cout << "compress [on|off]       - Show or set compression of full blocks" << endl;
+    cout << "snapshot create <name>  - Take a snapshot of the whole tree" << endl;
+    cout << "snapshot list           - List snapshots" << endl;
+    cout << "snapshot delete <name>  - Delete a snapshot" << endl;
+    cout << "ls|get|read @<snap>/<path> - Browse a snapshot read-only" << endl;
+    cout << "bench <kind> <count>    - Time bitmap, lookup, tree, directory or path structures" << endl;
     cout << "help                    - Show this help" << endl;
     cout << "exit                    - Exit program" << endl;
     cout << "================================\n"
          << endl;
 }
 
+bool parseSize(const string &text, size_t &value)
+{
+    if (text.empty() || !all_of(text.begin(), text.end(), [](char c)
+                                { return isdigit((unsigned char)c); }))
+        return false;
+
+    try
+    {
+        value = stoull(text);
+    }
+    catch (const out_of_range &)
+    {
+        return false;
+    }
+    return true;
+}
+
+string joinTokens(const vector<string> &tokens, size_t first)
+{
+    string text;
+    for (size_t i = first; i < tokens.size(); i++)
+    {
+        if (i > first)
+            text += " ";
+        text += tokens[i];
+    }
+    return text;
+}
+
 int main()
 {
     cout << "=== File System ===" << endl;
@@ -845,10 +4362,27 @@ int main()
         }
         else if (command == "ls")
         {
-            if (tokens.size() > 1)
-                fs.ls(tokens[1]);
+            string path, after, prefix;
+            size_t limit = SIZE_MAX;
+            bool valid = true;
+            for (size_t i = 1; i < tokens.size() && valid; i++)
+            {
+                if (tokens[i] == "--limit" && i + 1 < tokens.size())
+                    valid = parseSize(tokens[++i], limit);
+                else if (tokens[i] == "--after" && i + 1 < tokens.size())
+                    after = tokens[++i];
+                else if (tokens[i] == "--prefix" && i + 1 < tokens.size())
+                    prefix = tokens[++i];
+                else if (path.empty() && tokens[i].compare(0, 2, "--") != 0)
+                    path = tokens[i];
+                else
+                    valid = false;
+            }
+
+            if (!valid)
+                cerr << "Error: usage: ls [path] [--limit <n>] [--after <name>] [--prefix <text>]" << endl;
             else
-                fs.ls();
+                fs.ls(path, after, prefix, limit);
         }
         else if (command == "mkdir")
         {
@@ -901,6 +4435,33 @@ int main()
             else
                 fs.put(tokens[1], tokens[2]);
         }
+        else if (command == "read")
+        {
+            size_t offset, length;
+            if (tokens.size() < 4)
+                cerr << "Error: read requires a filename, offset and length" << endl;
+            else if (!parseSize(tokens[2], offset) || !parseSize(tokens[3], length))
+                cerr << "Error: read offset and length must be non-negative numbers" << endl;
+            else
+                fs.read(tokens[1], offset, length);
+        }
+        else if (command == "write")
+        {
+            size_t offset;
+            if (tokens.size() < 4)
+                cerr << "Error: write requires a filename, offset and text" << endl;
+            else if (!parseSize(tokens[2], offset))
+                cerr << "Error: write offset must be a non-negative number" << endl;
+            else
+                fs.write(tokens[1], offset, joinTokens(tokens, 3));
+        }
+        else if (command == "append")
+        {
+            if (tokens.size() < 3)
+                cerr << "Error: append requires a filename and text" << endl;
+            else
+                fs.append(tokens[1], joinTokens(tokens, 2));
+        }
         else if (command == "info")
         {
             if (tokens.size() < 2)
@@ -910,6 +4471,55 @@ int main()
         }
         else if (command == "defrag")
             fs.defrag();
+        else if (command == "df")
+            fs.df();
+        else if (command == "inline")
+        {
+            size_t bytes;
+            if (tokens.size() == 1)
+                fs.showInlineLimit();
+            else if (!parseSize(tokens[1], bytes))
+                cerr << "Error: inline limit must be a non-negative number" << endl;
+            else
+                fs.setInlineLimit(bytes);
+        }
+        else if (command == "tailpack")
+        {
+            if (tokens.size() == 1)
+                fs.showTailPacking();
+            else if (tokens[1] == "on" || tokens[1] == "off")
+                fs.setTailPacking(tokens[1] == "on");
+            else
+                cerr << "Error: usage: tailpack [on|off]" << endl;
+        }
+        else if (command == "compress")
+        {
+            if (tokens.size() == 1)
+                fs.showCompression();
+            else if (tokens[1] == "on" || tokens[1] == "off")
+                fs.setCompression(tokens[1] == "on");
+            else
+                cerr << "Error: usage: compress [on|off]" << endl;
+        }
+        else if (command == "snapshot")
+        {
+            if (tokens.size() == 2 && tokens[1] == "list")
+                fs.listSnapshots();
+            else if (tokens.size() == 3 && tokens[1] == "create")
+                fs.createSnapshot(tokens[2]);
+            else if (tokens.size() == 3 && tokens[1] == "delete")
+                fs.deleteSnapshot(tokens[2]);
+            else
+                cerr << "Error: usage: snapshot create|delete <name> or snapshot list" << endl;
+        }
+        else if (command == "bench")
+        {
+            size_t count;
+            if (tokens.size() != 3 || !parseSize(tokens[2], count))
+                cerr << "Error: usage: bench bitmap|lookup|tree|directory|path <count>" << endl;
+            else
+                fs.bench(tokens[1], count);
+        }
         else
         {
             cerr << "Error: Unknown command: " << command << endl;